@@ -0,0 +1,38 @@
+/**
+ * @brief bloom.h Contains definitions for bloom.cpp,
+ * a cache-blocked Bloom filter over table ids
+ *
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Blocked Bloom filter: every id sets k bits inside one 512-bit block,
+ *        so a test touches a single cache line
+ */
+class blocked_bloom
+{
+public:
+    static constexpr size_t bits_per_id = 12;
+    static constexpr size_t min_capacity = 1024;
+
+    blocked_bloom() { reset(min_capacity); }
+
+    void reset(size_t capacity);
+    void add(uint64_t hash);
+    bool may_contain(uint64_t hash) const;
+    bool overloaded() const { return nof_ids > capacity; }
+
+private:
+    static constexpr size_t words_per_block = 8; // 512 bits
+    static constexpr unsigned k = 8;
+
+    size_t block_of(uint64_t hash) const;
+
+    std::vector<uint64_t> words;
+    size_t nof_blocks = 0;
+    size_t capacity = 0;
+    size_t nof_ids = 0;
+};
@@ -9,6 +9,8 @@
 #include <string>
 #include <string.h>
 #include <vector>
+#include <optional>
+#include <cstdint>
 
 constexpr char CMD_DELIM = ' ';
 
@@ -22,6 +24,25 @@ struct templ_n_flag
 {
     const char *tmpl = NULL;
     bool flag = NO_ASKNOLEGEMENT;
+    bool accepts_modifiers = false; // FROM / TO / LIMIT / COUNT / APPROX may follow the keyword
+    const char *count_tmpl = NULL;  // template answering COUNT modifier
+};
+
+/**
+ * @brief Optional modifiers of join commands:
+ *        FROM id1 TO id2 restricts the id window, LIMIT n the number of rows.
+ *        Both are pushed down into the SQL request so that SQLite
+ *        scans only the index range and stops early.
+ *        COUNT replies with the number of rows only, APPROX with its estimate
+ *        taken from table sketches
+ */
+struct join_modifiers
+{
+    std::optional<int64_t> id_from;
+    std::optional<int64_t> id_to;
+    std::optional<uint64_t> limit;
+    bool count = false;
+    bool approx = false;
 };
 
 /**
@@ -41,15 +62,23 @@ class command
 {
 private:
     void request_by_template(const std::vector<std::string> &args);
+    void request_by_modifiers();
     void extract_args(std::vector<std::string> &args);
+    void extract_modifiers();
     std::string cmd;
+    std::string key;
+    std::vector<std::string> args;
     templ_n_flag templ_and_flag;
+    join_modifiers modifiers;
     static templ_n_flags templates;
 
 public:
     command(const std::string s_cmd);
-    std::string request;
+    std::string request; // empty if the command is answered without SQL
     bool send_asknolegement() { return templ_and_flag.flag; };
+    const join_modifiers &get_modifiers() const { return modifiers; }
+    std::string_view get_key() const { return key; }
+    const std::vector<std::string> &get_args() const { return args; }
 };
 
 /**
@@ -67,3 +96,20 @@ using cmdkey_char_t = char[sizeof(uint32_t)];
  * @return 
  */
 int replace_pattern(std::string &s, std::string_view pattern, std::string_view relpacement);
+
+/**
+ * @brief Builds SQL predicate restricting column to the id window of modifiers
+ * @param column Qualified column name, e.g. "A.id"
+ * @param mods Join modifiers
+ * @return Predicate, "TRUE" if no window is set
+ */
+std::string range_predicate(std::string_view column, const join_modifiers &mods);
+
+/**
+ * @brief Builds SQL request scanning a table in id order within the id window
+ * @param table table name
+ * @param mods Join modifiers, LIMIT is not applied
+ * @param with_names select names along with ids
+ * @return the request
+ */
+std::string ordered_scan_request(std::string_view table, const join_modifiers &mods, bool with_names);
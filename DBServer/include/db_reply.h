@@ -0,0 +1,106 @@
+/**
+ * @brief db_reply.h Contains definitions for db_reply.cpp,
+ * which encodes db results in the negotiated protocol
+ * and passes them to the foreign callback in batches
+ *
+ */
+#pragma once
+#include "wire_protocol.h"
+#include "latency.h"
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Symbol to add at the end of each db result
+ */
+constexpr unsigned char END_OF_REPLY = '^';
+
+/**
+ * @brief Symbol to add at the end of each row of db result
+ */
+constexpr unsigned char END_OF_CHUNK = '\n';
+
+/**
+ * @brief Encoded rows are passed on once the batch reaches this size
+ */
+constexpr size_t REPLY_BATCH_SIZE = 16 * 1024;
+
+/**
+ * @brief A batch of encoded reply passed to the foreign callback
+ */
+struct reply_batch_t
+{
+    std::string data;
+    uint32_t request_id = 0;
+    bool first = false; // the batch starts a reply
+    bool last = false;  // the batch ends a reply
+    command_kind_t kind = command_kind_t::other;
+    std::chrono::steady_clock::time_point queued; // the batch was queued for sending
+};
+
+typedef void (*foreign_callback_t)(void *, reply_batch_t);
+
+/**
+ * @brief A column of a result row
+ */
+struct column_t
+{
+    column_type_t type = column_type_t::null;
+    int64_t integer = 0;
+    std::string_view text;
+
+    column_t() = default;
+    column_t(int64_t i) : type(column_type_t::integer), integer(i) {}
+    column_t(std::string_view s) : type(column_type_t::text), text(s) {}
+    column_t(const char *s)
+    {
+        if (s)
+            *this = column_t(std::string_view(s));
+    }
+};
+
+/**
+ * @brief Encodes replies of one connection: CSV lines terminated by END_OF_REPLY
+ *        in text protocol, ROWS / OK / ERROR frames in binary protocol
+ */
+class reply_writer
+{
+private:
+    foreign_callback_t foreign_callback; // external callback to call for each batch
+    void *handle;                        // external id passed to the callback
+    protocol_t protocol = protocol_t::text;
+    uint32_t request_id = 0;
+    bool echo_id = false;       // prefix text lines by "#<request id> "
+    bool first_batch = true;    // no batch of the current reply is passed yet
+    command_kind_t kind = command_kind_t::other;
+    uint64_t rows = 0; // encoded since the writer was made
+    std::string batch;
+    size_t rows_frame = std::string::npos; // offset of open ROWS frame header in batch
+
+    void close_rows_frame();
+    void put_id_prefix();
+    void flush(bool last = false);
+
+public:
+    reply_writer(foreign_callback_t _foreign_callback, void *_handle)
+        : foreign_callback(_foreign_callback), handle(_handle) {}
+
+    void set_protocol(protocol_t _protocol) { protocol = _protocol; }
+    protocol_t get_protocol() const { return protocol; }
+    void begin(uint32_t _request_id, bool _echo_id = false)
+    {
+        request_id = _request_id;
+        echo_id = _echo_id;
+        first_batch = true;
+        kind = command_kind_t::other;
+    }
+    void set_kind(command_kind_t _kind) { kind = _kind; }
+    uint64_t get_rows() const { return rows; }
+
+    void row(const column_t *cols, size_t nof_cols);
+    void row(std::initializer_list<column_t> cols) { row(cols.begin(), cols.size()); }
+    void ok(std::string_view note = "");
+    void error(std::string_view msg);
+};
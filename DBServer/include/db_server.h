@@ -4,20 +4,117 @@
  */
 #pragma once
 #include "db_command.h"
+#include "db_reply.h"
+#include "sketch.h"
+#include "roaring.h"
+#include "bloom.h"
 #include "sqlite3.h"
+#include <array>
+#include <chrono>
+#include <optional>
+#include <vector>
+#include <utility>
 
 constexpr auto default_db_directory = "./db/";
+
+/**
+ * @brief INTERSECTION probes the larger table per row of the smaller one
+ *        when it holds at least SKEW_MIN_ROWS rows and SKEW_RATIO times more
+ *        than the smaller one; SYMMETRIC_DIFFERENCE merges ordered scans then
+ */
+constexpr uint64_t SKEW_RATIO = 32;
+constexpr uint64_t SKEW_MIN_ROWS = 4096;
+
+/**
+ * @brief An overloaded Bloom filter is replaced by one sized for twice the table,
+ *        filled by an ordered scan of the table BLOOM_GROW_STEP ids per insert
+ */
+constexpr int BLOOM_GROW_STEP = 64;
+
+/**
+ * @brief Tags of MERGE result rows: present in both tables, in A only, in B only
+ */
+constexpr std::array<const char *, 3> MERGE_TAGS{"both", "A only", "B only"};
+
+/**
+ * @brief Throws exception on sqlite error code
+ * @param code error code
+ * @param msg error message
+ */
+void sqlite_throw(int code, const char *msg = "");
+
+/**
+ * @brief In-memory summaries of a table, kept in step with INSERT / TRUNCATE
+ */
+struct table_state
+{
+    bool stale = false; // an insert could not be mirrored, rebuilt on demand
+    bool sketch_usable = true; // false once an id is not an integer, the sketch and Bloom filter miss it
+    table_sketch sketch;
+
+    blocked_bloom bloom;             // replaced by the growing one when overloaded
+    blocked_bloom growing;           // sized for twice the table, filled while bloom is overloaded
+    bool bloom_growing = false;      // growing is being filled
+    std::optional<int64_t> grown_to; // the last id scanned into growing
+
+    bool bitmap_enabled = false; // switched by BITMAP <table> ON|OFF
+    bool bitmap_usable = true;   // false once an id falls outside of uint32 range
+    roaring_bitmap bitmap;
+
+    void add(int64_t id);
+    void clear();
+};
+
 /**
- * @brief Symbol to add at the end of each db result
+ * @brief Acknowledgements of INSERT / TRUNCATE coalesced in quiet mode:
+ *        instead of an OK per command a single cumulative reply is sent
+ *        on FLUSH or once batch_size commands are acknowledged
  */
-constexpr unsigned char END_OF_REPLY = '^';
+struct ack_coalescer
+{
+    static constexpr size_t max_errors = 1000; // errors kept for the reply, the rest are counted only
+
+    bool quiet = false;
+    uint64_t batch_size = 0; // 0 - on FLUSH only
+    uint64_t seq = 0;        // commands coalesced since the last reply
+    uint64_t acked = 0;
+    uint64_t failed = 0;
+    std::vector<std::pair<uint64_t, std::string>> errors; // sequence number, message
+
+    void reset()
+    {
+        seq = acked = failed = 0;
+        errors.clear();
+    }
+};
 
 /**
- * @brief Symbol to add at the end of each row of db result
+ * @brief Resources used by a db: its commands, their CPU time and result rows,
+ *        memory held by its SQLite connection
  */
-constexpr unsigned char END_OF_CHUNK = '\n';
+struct db_usage_t
+{
+    uint64_t commands = 0;
+    uint64_t cpu_ns = 0; // CPU time of the thread executing the commands
+    uint64_t rows = 0;
+    int cache_bytes = 0;  // page cache
+    int schema_bytes = 0; // parsed schema
+    int stmt_bytes = 0;   // prepared statements
+};
 
-typedef void (*foreign_callback_t)(void *, std::string);
+/**
+ * @brief Statements of a slow command logged with their query plans at most
+ */
+constexpr size_t MAX_PROFILED_STATEMENTS = 8;
+
+/**
+ * @brief A statement of the current command as profiled by SQLite
+ */
+struct profiled_statement_t
+{
+    std::string sql;
+    int64_t ns;
+};
 
 /**
  * @brief db object
@@ -29,14 +126,45 @@ private:
     void *handle; // external id to store in db obj
     std::string db_path;
 
-    foreign_callback_t foreign_callback;           // external callback to call for each row of result
-    friend int db_callback(void *db, int nof_cols, // internal callback to call for each row of result
-                           char **cols_of_string,
-                           [[maybe_unused]] char **col_names);
+    static constexpr std::array<const char *, 2> table_names{"A", "B"};
+    std::array<table_state, 2> tables; // summaries of tables A and B
+
+    table_state *table_of(std::string_view table);
+    void rebuild_table(table_state &state);
+    void grow_bloom(table_state &state);
+    void refresh_stale_tables();
+    void maintain_tables(const command &cmd);
+    bool bitmaps_usable();
+    void reply_approx(const command &cmd);
+    void reply_merge(const command &cmd, bool unmatched_only = false);
+    int skewed_side();
+    void reply_probe(const command &cmd, int small);
+    void reply_bitmap(const command &cmd);
+    void switch_bitmap(const command &cmd);
+    int run_request(const std::string &request, std::string &errmsg);
+
+    ack_coalescer acks;
+    void switch_acks(const command &cmd);
+    void coalesce_ack(int ec, const std::string &errmsg);
+    void reply_acks();
+
+    reply_writer replies; // encodes result rows, passes them to the external callback
+    uint64_t commands = 0;
+    uint64_t cpu_ns = 0;
+
+    inline static std::chrono::nanoseconds slow_threshold{0}; // 0 - slow commands are not logged
+    std::vector<profiled_statement_t> profiled;                // longest statements of the current command
+    static int profile_callback(unsigned type, void *ctx, void *p, void *x);
+    std::string query_text(const std::string &sql, std::string_view separator = "");
+    void log_slow_command(const std::string &cmd, std::chrono::nanoseconds elapsed, uint64_t rows);
+    void dispatch_cmd(const std::string &cmd, uint32_t request_id, bool echo_id);
 
 public:
-    void execute_cmd(const std::string cmd);
+    void execute_cmd(const std::string cmd, uint32_t request_id = 0, bool echo_id = false);
+    reply_writer &get_replies() { return replies; }
+    db_usage_t get_usage();
     static void clean_directory(std::string _db_directory);
+    static void set_slow_threshold(std::chrono::nanoseconds threshold) { slow_threshold = threshold; }
     db_t(std::string _db_directory,
          foreign_callback_t, void *handle);
     ~db_t();
@@ -0,0 +1,178 @@
+/**
+ * @brief latency.h Contains definitions for latency.cpp,
+ * latency histograms per command kind and phase of its processing
+ *
+ */
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Kinds of commands latencies are recorded for
+ */
+enum class command_kind_t : uint8_t
+{
+    create,
+    truncate,
+    insert,
+    intersection,
+    symmetric_difference,
+    merge,
+    bitmap,
+    ack,
+    flush,
+    session, // PROTOCOL, SHM, COMPRESS, STATS and the like
+    other,   // not parsed
+    count
+};
+
+constexpr std::array<const char *, static_cast<size_t>(command_kind_t::count)> COMMAND_KIND_NAMES{
+    "CREATE", "TRUNCATE", "INSERT", "INTERSECTION", "SYMMETRIC_DIFFERENCE",
+    "MERGE", "BITMAP", "ACK", "FLUSH", "SESSION", "OTHER"};
+
+/**
+ * @brief Phases of a command:
+ * parse - the command text into SQL,
+ * execute - SQLite along with encoding of result rows,
+ * serialize - closing a reply batch and handing it over for sending, per batch,
+ *             a part of execute,
+ * send - from the last batch of a reply queued to the write carrying it done
+ */
+enum class latency_phase_t : uint8_t
+{
+    parse,
+    execute,
+    serialize,
+    send,
+    count
+};
+
+constexpr std::array<const char *, static_cast<size_t>(latency_phase_t::count)> LATENCY_PHASE_NAMES{
+    "parse", "execute", "serialize", "send"};
+
+/**
+ * @brief Histogram buckets are log-linear as in HdrHistogram: values below
+ * LATENCY_SUB_BUCKETS nanoseconds exactly, larger ones by LATENCY_SUB_BUCKETS
+ * buckets per power of 2, i.e. within 1 / LATENCY_SUB_BUCKETS of the value
+ */
+constexpr size_t LATENCY_SUB_BUCKETS = 16;
+constexpr size_t LATENCY_BUCKETS = (64 - 3) * LATENCY_SUB_BUCKETS; // any uint64_t value
+
+/**
+ * @brief Counts of a histogram taken for reading, may be merged with others
+ */
+struct latency_snapshot_t
+{
+    std::array<uint64_t, LATENCY_BUCKETS> counts{};
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    void merge(const latency_snapshot_t &other);
+    uint64_t percentile(double p) const;
+    uint64_t min() const;
+};
+
+/**
+ * @brief Latency histogram written by a single thread and read by any:
+ * relaxed atomic counters, no read-modify-write on the recording path
+ */
+class latency_histogram
+{
+private:
+    std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> counts{};
+    std::atomic<uint64_t> total = 0;
+    std::atomic<uint64_t> max = 0;
+
+    static void bump(std::atomic<uint64_t> &counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+public:
+    static size_t bucket_of(uint64_t ns);
+    static uint64_t value_of(size_t bucket);
+
+    void record(uint64_t ns)
+    {
+        bump(counts[bucket_of(ns)]);
+        bump(total);
+        if (ns > max.load(std::memory_order_relaxed))
+            max.store(ns, std::memory_order_relaxed);
+    }
+    void snapshot(latency_snapshot_t &out) const;
+    void reset();
+};
+
+/**
+ * @brief Histograms of a thread, by command kind and phase
+ */
+struct latency_stats_t
+{
+    std::array<std::array<latency_histogram, static_cast<size_t>(latency_phase_t::count)>,
+               static_cast<size_t>(command_kind_t::count)>
+        histograms;
+};
+
+/**
+ * @brief Registry of the histograms of all threads recording latencies
+ */
+class latency_registry
+{
+private:
+    std::mutex stats_mutex; // taken when a thread records first and by readers
+    std::vector<std::shared_ptr<latency_stats_t>> stats;
+
+public:
+    latency_stats_t &local_stats();
+    latency_snapshot_t snapshot(command_kind_t kind, latency_phase_t phase);
+    void reset();
+};
+
+inline latency_registry latencies;
+
+command_kind_t kind_of(std::string_view key);
+
+/**
+ * @brief Records latency of a phase in the histograms of the calling thread
+ */
+inline void record_latency(command_kind_t kind, latency_phase_t phase, std::chrono::nanoseconds ns)
+{
+    latencies.local_stats().histograms[static_cast<size_t>(kind)][static_cast<size_t>(phase)].record(
+        ns.count() > 0 ? static_cast<uint64_t>(ns.count()) : 0);
+}
+
+/**
+ * @brief Records the time from its construction or the last next() to its destruction
+ */
+class phase_timer
+{
+private:
+    command_kind_t kind;
+    latency_phase_t phase;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+public:
+    phase_timer(command_kind_t _kind, latency_phase_t _phase) : kind(_kind), phase(_phase) {}
+    phase_timer(const phase_timer &) = delete;
+    phase_timer &operator=(const phase_timer &) = delete;
+    ~phase_timer() { record_latency(kind, phase, std::chrono::steady_clock::now() - start); }
+
+    void set_kind(command_kind_t _kind) { kind = _kind; }
+
+    /**
+     * @brief Records the current phase and starts timing the next one
+     */
+    void next(latency_phase_t _phase)
+    {
+        auto now = std::chrono::steady_clock::now();
+        record_latency(kind, phase, now - start);
+        phase = _phase;
+        start = now;
+    }
+};
@@ -0,0 +1,177 @@
+/**
+ * @brief logger.h Contains definitions for logger.cpp,
+ *        asynchronous logging of join_server and its db library
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+enum class log_level_t : uint8_t
+{
+    debug,
+    info,
+    warning,
+    error
+};
+
+constexpr size_t LOG_MESSAGE_SIZE = 240; // longer messages are cut
+constexpr size_t LOG_RING_SIZE = 1024;   // records per thread, a power of 2
+constexpr uint32_t LOG_RATE_PER_SECOND = 100; // messages per call site and thread
+
+/**
+ * @brief A message waiting to be written
+ */
+struct log_record_t
+{
+    int64_t time_us;
+    log_level_t level;
+    uint16_t length;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+/**
+ * @brief Single producer single consumer ring of records: the producer is
+ * the thread owning the ring, the consumer is the drain thread.
+ * A full ring drops records instead of waiting
+ */
+struct log_ring_t
+{
+    std::array<log_record_t, LOG_RING_SIZE> records;
+    alignas(64) std::atomic<uint64_t> head = 0; // next record to be written by the producer
+    alignas(64) std::atomic<uint64_t> tail = 0; // next record to be taken by the consumer
+    std::atomic<uint64_t> dropped = 0;
+    uint32_t thread_id = 0;
+};
+
+/**
+ * @brief Rate limit of a log call site in a thread: LOG_RATE_PER_SECOND
+ * messages per second, the rest is counted and reported with the next message let through
+ */
+struct log_rate_t
+{
+    int64_t second = 0;
+    uint32_t count = 0;
+    uint32_t suppressed = 0;
+
+    bool admit(uint32_t &reported);
+};
+
+/**
+ * @brief Logger: every thread formats its messages into its own ring,
+ * a background thread drains the rings and does the file I/O
+ */
+class logger_t
+{
+private:
+    std::mutex rings_mutex; // taken when a thread logs first and by the drain thread
+    std::vector<std::shared_ptr<log_ring_t>> rings;
+    std::thread drainer;
+    std::atomic<bool> running = false;
+    std::atomic<log_level_t> min_level = log_level_t::info;
+    FILE *out = stderr;
+
+    log_ring_t &local_ring();
+    size_t drain();
+    void drain_loop();
+
+    static void append(char *text, size_t &length, std::string_view s)
+    {
+        auto n = std::min(s.size(), LOG_MESSAGE_SIZE - length);
+        std::memcpy(text + length, s.data(), n);
+        length += n;
+    }
+    template <typename T>
+        requires std::integral<T> || std::floating_point<T>
+    static void append(char *text, size_t &length, T value)
+    {
+        if constexpr (std::is_same_v<T, bool>)
+            append(text, length, value ? std::string_view("true") : std::string_view("false"));
+        else if constexpr (std::is_same_v<T, char>)
+            append(text, length, std::string_view(&value, 1));
+        else
+            length = std::to_chars(text + length, text + LOG_MESSAGE_SIZE, value).ptr - text;
+    }
+    static void append(char *text, size_t &length, const char *s)
+    {
+        append(text, length, std::string_view(s ? s : "(null)"));
+    }
+
+public:
+    logger_t() = default;
+    ~logger_t() { stop(); }
+
+    void start(log_level_t level, FILE *_out = stderr);
+    void stop();
+    bool enabled(log_level_t level) const { return level >= min_level.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Formats a message into the ring of the calling thread, never blocks
+     * @param level message level
+     * @param suppressed messages suppressed by the rate limit before this one
+     * @param args message parts: strings and numbers
+     */
+    template <typename... Args>
+    void log(log_level_t level, uint32_t suppressed, const Args &...args)
+    {
+        auto &ring = local_ring();
+        auto head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.tail.load(std::memory_order_acquire) == LOG_RING_SIZE)
+        {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto &record = ring.records[head & (LOG_RING_SIZE - 1)];
+        size_t length = 0;
+        (append(record.text, length, args), ...);
+        if (suppressed)
+        {
+            append(record.text, length, " (");
+            append(record.text, length, suppressed);
+            append(record.text, length, " similar suppressed)");
+        }
+        record.length = static_cast<uint16_t>(length);
+        record.level = level;
+        record.time_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::system_clock::now().time_since_epoch())
+                             .count();
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+};
+
+inline logger_t logger;
+
+/**
+ * @brief Logs a message made of strings and numbers if the level is enabled,
+ * rate limited per call site
+ */
+#define LOG(level, ...)                                                \
+    do                                                                 \
+    {                                                                  \
+        if (logger.enabled(level))                                     \
+        {                                                              \
+            static thread_local log_rate_t log_rate_;                  \
+            uint32_t log_suppressed_;                                  \
+            if (log_rate_.admit(log_suppressed_))                      \
+                logger.log(level, log_suppressed_, __VA_ARGS__);       \
+        }                                                              \
+    } while (0)
+
+#define LOG_DEBUG(...) LOG(log_level_t::debug, __VA_ARGS__)
+#define LOG_INFO(...) LOG(log_level_t::info, __VA_ARGS__)
+#define LOG_WARNING(...) LOG(log_level_t::warning, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(log_level_t::error, __VA_ARGS__)
@@ -0,0 +1,23 @@
+/**
+ * @brief probes.h Static USDT probes of join_server and its db library,
+ * built in by JOIN_SERVER_WITH_USDT and listed by e.g. "bpftrace -l 'usdt:./join_server:*'".
+ * A probe is a nop in the code until a tracer attaches to it, without
+ * JOIN_SERVER_WITH_USDT it is not compiled at all, its args are not evaluated
+ *
+ *   command_received(connection, request id, command, length) - join_server.cpp
+ *   command_parsed(command, SQL request)                       - db_command.cpp
+ *   sql_start(SQL), sql_end(SQL, sqlite result code)           - db_server.cpp
+ *   row_emitted(request id, number of columns)                 - db_reply.cpp
+ *   reply_flushed(connection, bytes)                           - join_server.cpp
+ */
+#pragma once
+
+#ifdef JOIN_SERVER_WITH_USDT
+#include <sys/sdt.h>
+#define JOIN_SERVER_PROBE(name, ...) STAP_PROBEV(join_server, name, __VA_ARGS__)
+#else
+#define JOIN_SERVER_PROBE(name, ...) \
+    do                               \
+    {                                \
+    } while (0)
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @brief roaring.h Contains definitions for roaring.cpp,
+ * a compressed bitmap of 32-bit ids in the spirit of Roaring bitmaps
+ *
+ */
+#pragma once
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Set of 32-bit ids split by the high 16 bits into containers.
+ *        A sparse container keeps a sorted array of low 16 bits,
+ *        a dense one (more than 4096 ids) a 65536-bit bitmap,
+ *        so AND / XOR of dense containers are plain word-wise loops
+ */
+class roaring_bitmap
+{
+public:
+    void add(uint32_t id);
+    bool contains(uint32_t id) const;
+    void clear() { containers.clear(); }
+    uint64_t cardinality(uint32_t from = 0, uint32_t to = UINT32_MAX) const;
+
+    static roaring_bitmap intersection(const roaring_bitmap &a, const roaring_bitmap &b,
+                                       uint32_t from, uint32_t to);
+    static roaring_bitmap symmetric_difference(const roaring_bitmap &a, const roaring_bitmap &b,
+                                               uint32_t from, uint32_t to);
+
+    /**
+     * @brief Calls f for ids in [from, to] in ascending order while f returns true
+     */
+    template <typename F>
+    void for_each(uint32_t from, uint32_t to, F f) const
+    {
+        for (auto &c : containers)
+        {
+            uint32_t base = uint32_t(c.key) << 16;
+            if (c.key < (from >> 16))
+                continue;
+            if (c.key > (to >> 16))
+                return;
+            auto visit = [&](uint32_t id)
+            { return id < from || id > to || f(id); };
+            if (c.is_bitmap())
+            {
+                for (size_t w = 0; w < words_per_bitmap; ++w)
+                    for (auto word = c.bits[w]; word; word &= word - 1)
+                        if (!visit(base | uint32_t(w * 64 + std::countr_zero(word))))
+                            return;
+            }
+            else
+                for (auto low : c.array)
+                    if (!visit(base | low))
+                        return;
+        }
+    }
+
+private:
+    static constexpr size_t max_array_size = 4096;
+    static constexpr size_t words_per_bitmap = 65536 / 64;
+
+    struct container
+    {
+        uint16_t key = 0;
+        uint32_t card = 0;
+        std::vector<uint16_t> array; // sorted low bits, if sparse
+        std::vector<uint64_t> bits;  // bitmap, if dense
+
+        bool is_bitmap() const { return !bits.empty(); }
+        bool contains(uint16_t low) const;
+        void to_bitmap();
+        void shrink();
+    };
+
+    static roaring_bitmap combine(const roaring_bitmap &a, const roaring_bitmap &b,
+                                  uint32_t from, uint32_t to, bool is_xor);
+    static container combine_containers(const container &a, const container &b, bool is_xor);
+
+    std::vector<container> containers; // sorted by key
+};
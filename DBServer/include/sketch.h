@@ -0,0 +1,91 @@
+/**
+ * @brief sketch.h Contains definitions for sketch.cpp,
+ * probabilistic id-set summaries used to answer approximate
+ * cardinality requests without touching the tables
+ *
+ */
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Mixes an id into a well distributed 64-bit hash (splitmix64 finalizer)
+ * @param id table id
+ * @return hash
+ */
+inline uint64_t id_hash(int64_t id)
+{
+    uint64_t x = static_cast<uint64_t>(id) + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief HyperLogLog distinct counter, mergeable by register-wise max
+ */
+class hyperloglog
+{
+public:
+    static constexpr unsigned precision = 14;
+    static constexpr size_t nof_registers = size_t(1) << precision;
+
+    void add(uint64_t hash);
+    void merge(const hyperloglog &other);
+    void clear() { registers.fill(0); }
+    double estimate() const;
+
+private:
+    std::array<uint8_t, nof_registers> registers{};
+};
+
+/**
+ * @brief Bottom-k MinHash: keeps k smallest hashes of a set,
+ *        used to estimate Jaccard similarity of two sets
+ */
+class minhash
+{
+public:
+    static constexpr size_t k = 256;
+
+    void add(uint64_t hash);
+    void clear() { heap.clear(); }
+    static double jaccard(const minhash &a, const minhash &b);
+
+private:
+    std::vector<uint64_t> heap; // max-heap of the k smallest hashes
+};
+
+/**
+ * @brief Per-table summary maintained on INSERT / TRUNCATE
+ */
+struct table_sketch
+{
+    uint64_t rows = 0; // exact number of rows
+    hyperloglog hll;
+    minhash mh;
+
+    void add(int64_t id);
+    void clear();
+};
+
+/**
+ * @brief Approximate cardinalities of set operations over two tables
+ */
+struct set_estimate
+{
+    double intersection;
+    double symmetric_difference;
+};
+
+/**
+ * @brief Estimates |A ∩ B| and |A Δ B| from the tables' sketches:
+ *        |A ∪ B| comes from merged HyperLogLog registers, the intersection
+ *        from Jaccard similarity times union, both clamped by exact row counts
+ * @param a sketch of the first table
+ * @param b sketch of the second table
+ * @return estimates
+ */
+set_estimate estimate_set_operations(const table_sketch &a, const table_sketch &b);
@@ -0,0 +1,102 @@
+/**
+ * @brief trace.h Contains definitions for trace.cpp,
+ * spans of request processing written as Chrome / Perfetto trace JSON
+ *
+ */
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Events a thread keeps at most, later ones are dropped and counted
+ */
+constexpr size_t TRACE_BUFFER_EVENTS = 1 << 18;
+
+/**
+ * @brief A complete span: name and argument name are string literals
+ */
+struct trace_event_t
+{
+    const char *name;
+    const char *arg_name; // nullptr if the span has no argument
+    uint64_t arg;
+    int64_t begin_ns;
+    int64_t duration_ns;
+};
+
+/**
+ * @brief Events of a thread: appended by the thread, read by the writer
+ * up to the count published
+ */
+struct trace_buffer_t
+{
+    std::unique_ptr<trace_event_t[]> events{new trace_event_t[TRACE_BUFFER_EVENTS]};
+    std::atomic<size_t> count = 0;
+    std::atomic<uint64_t> dropped = 0;
+    uint32_t thread_id = 0;
+};
+
+/**
+ * @brief Collects spans in per-thread buffers while tracing is on,
+ * when it is off a span costs a relaxed load
+ */
+class tracer_t
+{
+private:
+    std::atomic<bool> on = false;
+    std::atomic<bool> finished = false;
+    std::string path; // file written by finish
+    std::mutex buffers_mutex; // taken when a thread traces first and by the writer
+    std::vector<std::shared_ptr<trace_buffer_t>> buffers;
+
+    trace_buffer_t &local_buffer();
+
+public:
+    void start(const std::string &_path)
+    {
+        path = _path;
+        on.store(true, std::memory_order_relaxed);
+    }
+    void stop() { on.store(false, std::memory_order_relaxed); }
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+    void record(const char *name, const char *arg_name, uint64_t arg, int64_t begin_ns, int64_t end_ns);
+    bool write(const std::string &path);
+    bool finish();
+
+    static int64_t now_ns()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+};
+
+inline tracer_t tracer;
+
+/**
+ * @brief Records a span from its construction to its destruction if tracing is on
+ */
+class trace_span
+{
+private:
+    const char *name;
+    const char *arg_name;
+    uint64_t arg;
+    int64_t begin_ns = tracer.enabled() ? tracer_t::now_ns() : 0;
+
+public:
+    explicit trace_span(const char *_name, const char *_arg_name = nullptr, uint64_t _arg = 0)
+        : name(_name), arg_name(_arg_name), arg(_arg) {}
+    trace_span(const trace_span &) = delete;
+    trace_span &operator=(const trace_span &) = delete;
+    ~trace_span()
+    {
+        if (begin_ns)
+            tracer.record(name, arg_name, arg, begin_ns, tracer_t::now_ns());
+    }
+};
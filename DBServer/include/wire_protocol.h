@@ -0,0 +1,140 @@
+/**
+ * @brief wire_protocol.h Binary framing shared by join_server, its db library
+ * and clients. It is negotiated by the text command "PROTOCOL BINARY",
+ * after which every request and reply travels in frames:
+ *
+ *   header:  opcode (1 byte), request id (4 bytes), payload length (4 bytes)
+ *   payload: command text for COMMAND frames,
+ *            a sequence of rows for ROWS frames,
+ *            an optional note for OK frames, the message for ERROR frames
+ *
+ * A row is the number of columns (2 bytes) followed by columns, each being
+ * a type byte and a fixed-width integer or a length-prefixed (4 bytes) text.
+ * A reply is any number of ROWS frames terminated by an OK or ERROR frame.
+ * All integers are little-endian.
+ *
+ * Every reply frame echoes the request id of its command, so a client may
+ * pipeline commands: replies that fit a single batch (acknowledgements,
+ * errors, short results) may overtake the batches of a long result.
+ * In text protocol a command may be tagged as "#<request id> <command>";
+ * every line of its reply is then prefixed by "#<request id> ",
+ * text replies are never reordered.
+ *
+ * A client connected by the Unix domain socket may ask for a shared memory
+ * ring by "SHM <bytes>" in binary protocol. The memfd of the ring comes as
+ * SCM_RIGHTS ancillary data no later than the OK frame of the command.
+ * From then on long reply batches are copied into the ring and announced by
+ * SHM_DATA frames in their place: offset and length of the batch frames in
+ * the ring (4 bytes each) and a release mark (8 bytes). The client hands the
+ * mark of the last batch it is done with back by a SHM_RELEASE frame,
+ * so that the space can be reused.
+ *
+ * "COMPRESS ZLIB|LZ4|ZSTD|NONE" in binary protocol starts a new compression
+ * stream for the replies; its OK frame precedes every frame compressed by it.
+ * Reply batches are then sent in COMPRESSED frames: the codec (1 byte),
+ * the length of the original frames (4 bytes) and their compressed bytes,
+ * flushed so that every COMPRESSED frame can be decompressed on arrival.
+ * A client keeps one decompression stream fed by COMPRESSED frames in order.
+ */
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+enum class protocol_t : uint8_t
+{
+    text,
+    binary
+};
+
+enum class opcode_t : uint8_t
+{
+    command = 1,    // client to server, payload is command text
+    disconnect = 2, // client to server, empty payload
+    rows = 3,       // server to client
+    ok = 4,         // server to client, ends a reply
+    error = 5,      // server to client, ends a reply
+    shm_data = 6,    // server to client, reply batch placed in shared memory
+    shm_release = 7, // client to server, 8 bytes release mark
+    compressed = 8   // server to client, frames of a reply batch compressed
+};
+
+enum class column_type_t : uint8_t
+{
+    null = 0,
+    integer = 1, // 8 bytes
+    text = 2     // 4 bytes length, then bytes
+};
+
+constexpr size_t FRAME_HEADER_SIZE = 9;
+
+/**
+ * @brief Decoded frame header
+ */
+struct frame_header_t
+{
+    opcode_t opcode;
+    uint32_t request_id;
+    uint32_t length;
+};
+
+/**
+ * @brief Appends an integer in little-endian byte order
+ */
+template <typename T>
+inline void put_le(std::string &out, T value)
+{
+    for (size_t i = 0; i < sizeof(T); ++i)
+        out.push_back(static_cast<char>((static_cast<uint64_t>(value) >> (8 * i)) & 0xff));
+}
+
+/**
+ * @brief Reads a little-endian integer
+ */
+template <typename T>
+inline T get_le(const char *p)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+        value |= uint64_t(static_cast<unsigned char>(p[i])) << (8 * i);
+    return static_cast<T>(value);
+}
+
+/**
+ * @brief Appends a frame header
+ * @param out output buffer
+ * @param header the header
+ */
+inline void put_frame_header(std::string &out, const frame_header_t &header)
+{
+    out.push_back(static_cast<char>(header.opcode));
+    put_le(out, header.request_id);
+    put_le(out, header.length);
+}
+
+/**
+ * @brief Decodes a frame header
+ * @param p FRAME_HEADER_SIZE bytes
+ * @return the header
+ */
+inline frame_header_t get_frame_header(const char *p)
+{
+    return {static_cast<opcode_t>(p[0]), get_le<uint32_t>(p + 1), get_le<uint32_t>(p + 5)};
+}
+
+/**
+ * @brief Builds a whole frame
+ * @param opcode frame opcode
+ * @param request_id request id
+ * @param payload frame payload
+ * @return the frame
+ */
+inline std::string make_frame(opcode_t opcode, uint32_t request_id, std::string_view payload = {})
+{
+    std::string frame;
+    frame.reserve(FRAME_HEADER_SIZE + payload.size());
+    put_frame_header(frame, {opcode, request_id, static_cast<uint32_t>(payload.size())});
+    frame.append(payload);
+    return frame;
+}
@@ -0,0 +1,62 @@
+/**
+ * @brief bloom.cpp
+ * Cache-blocked Bloom filter over table ids
+ *
+ */
+#include "bloom.h"
+
+/**
+ * @brief Empties the filter and sizes it for a number of ids
+ * @param _capacity number of ids the filter is sized for
+ */
+void blocked_bloom::reset(size_t _capacity)
+{
+    capacity = _capacity < min_capacity ? min_capacity : _capacity;
+    nof_blocks = (capacity * bits_per_id + 511) / 512;
+    words.assign(nof_blocks * words_per_block, 0);
+    nof_ids = 0;
+}
+
+/**
+ * @brief Selects the block by the high half of the hash
+ * @param hash hashed id
+ * @return index of the first word of the block
+ */
+size_t blocked_bloom::block_of(uint64_t hash) const
+{
+    return static_cast<size_t>(((hash >> 32) * nof_blocks) >> 32) * words_per_block;
+}
+
+/**
+ * @brief Adds an id, k bits of its block are selected by overlapping 9-bit slices of a remixed hash
+ * @param hash hashed id
+ */
+void blocked_bloom::add(uint64_t hash)
+{
+    auto block = words.data() + block_of(hash);
+    uint64_t h = hash * 0x9e3779b97f4a7c15ULL;
+    for (unsigned i = 0; i < k; ++i, h >>= 7)
+    {
+        unsigned bit = h & 511;
+        block[bit >> 6] |= uint64_t(1) << (bit & 63);
+    }
+    ++nof_ids;
+}
+
+/**
+ * @brief Tests an id
+ * @param hash hashed id
+ * @return false if the id was never added, true if it may have been
+ */
+bool blocked_bloom::may_contain(uint64_t hash) const
+{
+    auto block = words.data() + block_of(hash);
+    uint64_t h = hash * 0x9e3779b97f4a7c15ULL;
+    for (unsigned i = 0; i < k; ++i, h >>= 7)
+    {
+        unsigned bit = h & 511;
+        if (!(block[bit >> 6] & (uint64_t(1) << (bit & 63))))
+            return false;
+    }
+    return true;
+}
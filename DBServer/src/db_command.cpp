@@ -5,12 +5,15 @@
  *
  */
 #include "db_command.h"
+#include "probes.h"
 #include <cstring>
 #include <cstdarg>
 #include <string>
 #include <string_view>
 #include <vector>
 #include <sstream>
+#include <stdexcept>
+#include <charconv>
 
 /**
  * @brief Command object constructor producing SQL requests from relational algebra commands
@@ -18,15 +21,27 @@
  */
 command::command(const std::string s_cmd) : cmd(s_cmd)
 {
-    std::vector<std::string> args;
-
-    auto key = std::string_view(s_cmd.begin(), s_cmd.begin() + sizeof(cmdkey_char_t) - 1);
-    templ_and_flag = templates[key];
+    if (s_cmd.size() < sizeof(cmdkey_char_t) - 1)
+        throw std::invalid_argument("Unknown command");
+    key = s_cmd.substr(0, sizeof(cmdkey_char_t) - 1);
+    auto it = templates.t_n_fs.find(key);
+    if (it == templates.t_n_fs.end())
+        throw std::invalid_argument("Unknown command");
+    templ_and_flag = it->second;
     // stateful_sv ssv_cmd(cmd);
     // ssv_cmd.fetch_next_word(CMD_DELIM); // skip keyword
 
-    extract_args(args);
-    request_by_template(args);
+    if (templ_and_flag.accepts_modifiers)
+    {
+        extract_modifiers();
+        request_by_modifiers();
+    }
+    else
+    {
+        extract_args(args);
+        request_by_template(args);
+    }
+    JOIN_SERVER_PROBE(command_parsed, cmd.c_str(), request.c_str());
 }
 
 /**
@@ -53,6 +68,68 @@ void command::extract_args(std::vector<std::string> &args)
     }
 }
 
+/**
+ * @brief Parses a numeric modifier value
+ * @param word modifier value
+ * @param keyword modifier name, used in error message
+ * @return parsed value
+ */
+template <typename T>
+static T parse_modifier(const std::string &word, std::string_view keyword)
+{
+    T value{};
+    auto [ptr, ec] = std::from_chars(word.data(), word.data() + word.size(), value);
+    if (ec != std::errc() || ptr != word.data() + word.size())
+        throw std::invalid_argument("Bad " + std::string(keyword) + " value: " + word);
+    return value;
+}
+
+/**
+ * @brief Extracts FROM id1 / TO id2 / LIMIT n modifiers following the keyword
+ */
+void command::extract_modifiers()
+{
+    std::istringstream s(cmd);
+    std::string word, value;
+    s >> word; // skip keyword
+    while (s >> word)
+    {
+        if (word == "COUNT" || word == "APPROX")
+        {
+            modifiers.count = true;
+            modifiers.approx = modifiers.approx || word == "APPROX";
+            continue;
+        }
+        if (!(s >> value))
+            throw std::invalid_argument("Missing value for " + word);
+        if (word == "FROM")
+            modifiers.id_from = parse_modifier<int64_t>(value, word);
+        else if (word == "TO")
+            modifiers.id_to = parse_modifier<int64_t>(value, word);
+        else if (word == "LIMIT")
+            modifiers.limit = parse_modifier<uint64_t>(value, word);
+        else
+            throw std::invalid_argument("Unknown modifier " + word);
+    }
+    if (modifiers.approx && (modifiers.id_from || modifiers.id_to || modifiers.limit))
+        throw std::invalid_argument("APPROX can not be combined with FROM, TO or LIMIT");
+}
+
+/**
+ * @brief Substitutes join modifiers into SQL template:
+ *        %RANGE_A / %RANGE_B by id window predicates, %LIMIT by LIMIT clause
+ */
+void command::request_by_modifiers()
+{
+    if (modifiers.approx)
+        return; // answered from sketches
+    request = modifiers.count ? templ_and_flag.count_tmpl : templ_and_flag.tmpl;
+    replace_pattern(request, "%RANGE_A", range_predicate("A.id", modifiers));
+    replace_pattern(request, "%RANGE_B", range_predicate("B.id", modifiers));
+    replace_pattern(request, "%LIMIT",
+                    modifiers.limit ? " LIMIT " + std::to_string(*modifiers.limit) : "");
+}
+
 /**
  * @brief Substitutes arguments from relational algebra command
  *        into SQL template
@@ -83,7 +160,11 @@ templ_n_flags::templ_n_flags()
         truncate_key{"TRU"},
         insert_key{"INS"},
         intersection_key{"INT"},
-        symmetric_difference_key{"SYM"};
+        symmetric_difference_key{"SYM"},
+        merge_key{"MER"},
+        bitmap_key{"BIT"},
+        ack_key{"ACK"},
+        flush_key{"FLU"};
 
     templ_n_flag create_templ = {/*"PRAGMA journal_mode=WAL;"
                                  "PRAGMA synchronous=NORMAL;"*/
@@ -96,33 +177,74 @@ templ_n_flags::templ_n_flags()
                                    SEND_ASKNOLEGEMENT};
     templ_n_flag insert_templ = {"INSERT INTO %1 (id, name) VALUES (%2, '%3');",
                                  SEND_ASKNOLEGEMENT};
+    // The id window is applied to both sides, so SQLite searches
+    // both primary key indexes by range; the ordered index scan
+    // lets LIMIT stop the join early
     templ_n_flag intersection_templ = {"SELECT A.id AS id,"
                                        "A.name AS Aname, "
                                        "B.name AS Bname "
                                        "FROM A AS A INNER JOIN B AS B "
                                        "ON(A.id = B.id) "
-                                       "ORDER BY id;",
-                                       SEND_ASKNOLEGEMENT};
-    templ_n_flag symm_diff_templ = {"SELECT "
-                                    "CASE "
-                                    "   WHEN A.id IS NOT NULL THEN A.id "
-                                    "   ELSE B.id "
-                                    "END As id,"
+                                       "WHERE %RANGE_A AND %RANGE_B "
+                                       "ORDER BY id%LIMIT;",
+                                       SEND_ASKNOLEGEMENT, true,
+                                       // count over covering indexes only, names are never read
+                                       "SELECT count(*) FROM ("
+                                       "SELECT 1 FROM A AS A INNER JOIN B AS B "
+                                       "ON(A.id = B.id) "
+                                       "WHERE %RANGE_A AND %RANGE_B%LIMIT);"};
+    // Symmetric difference as two ordered anti-joins merged by UNION ALL:
+    // unlike FULL JOIN it needs no temporary b-tree for ORDER BY,
+    // so rows are streamed in id order and LIMIT terminates the scan early
+    templ_n_flag symm_diff_templ = {"SELECT A.id AS id,"
                                     "A.name AS name,"
+                                    "NULL AS Bname "
+                                    "FROM A AS A "
+                                    "WHERE %RANGE_A AND NOT EXISTS (SELECT 1 FROM B WHERE B.id = A.id) "
+                                    "UNION ALL "
+                                    "SELECT B.id AS id,"
+                                    "NULL AS name,"
                                     "B.name AS Bname "
-                                    "FROM A AS A FULL JOIN B AS B ON(A.id = B.id) "
-                                    "WHERE A.id IS NULL OR B.id IS NULL "
-                                    "ORDER BY CASE "
-                                    "   WHEN A.id IS NOT NULL THEN A.id "
-                                    "   ELSE B.id "
-                                    "END;",
-                                    SEND_ASKNOLEGEMENT};
+                                    "FROM B AS B "
+                                    "WHERE %RANGE_B AND NOT EXISTS (SELECT 1 FROM A WHERE A.id = B.id) "
+                                    "ORDER BY 1%LIMIT;",
+                                    SEND_ASKNOLEGEMENT, true,
+                                    "SELECT count(*) FROM ("
+                                    "SELECT A.id FROM A AS A "
+                                    "WHERE %RANGE_A AND NOT EXISTS (SELECT 1 FROM B WHERE B.id = A.id) "
+                                    "UNION ALL "
+                                    "SELECT B.id FROM B AS B "
+                                    "WHERE %RANGE_B AND NOT EXISTS (SELECT 1 FROM A WHERE A.id = B.id)%LIMIT);"};
+
+    // Two ordered cursors, merged by db_t in a single pass over both indexes;
+    // each side needs at most LIMIT rows to produce LIMIT merged rows
+    templ_n_flag merge_templ = {"SELECT id, name FROM A AS A "
+                                "WHERE %RANGE_A ORDER BY id%LIMIT;"
+                                "SELECT id, name FROM B AS B "
+                                "WHERE %RANGE_B ORDER BY id%LIMIT;",
+                                SEND_ASKNOLEGEMENT, true,
+                                "SELECT id FROM A AS A "
+                                "WHERE %RANGE_A ORDER BY id%LIMIT;"
+                                "SELECT id FROM B AS B "
+                                "WHERE %RANGE_B ORDER BY id%LIMIT;"};
+
+    // BITMAP <table> ON|OFF switches the table's id bitmap, answered by db_t
+    templ_n_flag bitmap_templ = {"", SEND_ASKNOLEGEMENT};
+
+    // ACK QUIET [n] | ACK EACH switches acknowledgement coalescing,
+    // FLUSH replies with the acknowledgements coalesced so far; answered by db_t
+    templ_n_flag ack_templ = {"", SEND_ASKNOLEGEMENT};
+    templ_n_flag flush_templ = {"", SEND_ASKNOLEGEMENT};
 
     t_n_fs.emplace(std::pair{create_key, create_templ});
     t_n_fs.emplace(std::pair{truncate_key, truncate_templ});
     t_n_fs.emplace(std::pair{insert_key, insert_templ});
     t_n_fs.emplace(std::pair{intersection_key, intersection_templ});
     t_n_fs.emplace(std::pair{symmetric_difference_key, symm_diff_templ});
+    t_n_fs.emplace(std::pair{merge_key, merge_templ});
+    t_n_fs.emplace(std::pair{bitmap_key, bitmap_templ});
+    t_n_fs.emplace(std::pair{ack_key, ack_templ});
+    t_n_fs.emplace(std::pair{flush_key, flush_templ});
 }
 
 /**
@@ -144,3 +266,35 @@ int replace_pattern(std::string &s, std::string_view pattern, std::string_view r
     }
     return cnt;
 }
+
+/**
+ * @brief Builds SQL predicate restricting column to the id window of modifiers
+ * @param column Qualified column name, e.g. "A.id"
+ * @param mods Join modifiers
+ * @return Predicate, "TRUE" if no window is set
+ */
+std::string range_predicate(std::string_view column, const join_modifiers &mods)
+{
+    std::string col(column);
+    if (mods.id_from && mods.id_to)
+        return col + " BETWEEN " + std::to_string(*mods.id_from) + " AND " + std::to_string(*mods.id_to);
+    if (mods.id_from)
+        return col + " >= " + std::to_string(*mods.id_from);
+    if (mods.id_to)
+        return col + " <= " + std::to_string(*mods.id_to);
+    return "TRUE";
+}
+
+/**
+ * @brief Builds SQL request scanning a table in id order within the id window
+ * @param table table name
+ * @param mods Join modifiers, LIMIT is not applied
+ * @param with_names select names along with ids
+ * @return the request
+ */
+std::string ordered_scan_request(std::string_view table, const join_modifiers &mods, bool with_names)
+{
+    std::string t(table);
+    return std::string("SELECT id") + (with_names ? ", name" : "") + " FROM " + t + " AS " + t +
+           " WHERE " + range_predicate(t + ".id", mods) + " ORDER BY id;";
+}
@@ -0,0 +1,139 @@
+/**
+ * @brief db_reply.cpp
+ * Encodes db results in the negotiated protocol
+ *
+ */
+#include "db_reply.h"
+#include "probes.h"
+#include <string>
+
+/**
+ * @brief Encodes a result row into the batch, passes the batch on when it is full
+ * @param cols columns of the row
+ * @param nof_cols number of columns
+ */
+void reply_writer::row(const column_t *cols, size_t nof_cols)
+{
+    ++rows;
+    JOIN_SERVER_PROBE(row_emitted, request_id, nof_cols);
+    if (protocol == protocol_t::text)
+    {
+        put_id_prefix();
+        for (size_t i = 0; i < nof_cols; ++i)
+        {
+            if (cols[i].type == column_type_t::integer)
+                batch += std::to_string(cols[i].integer);
+            else
+                batch += cols[i].text;
+            batch += (i == nof_cols - 1) ? "" : ",";
+        }
+        batch.push_back(END_OF_CHUNK);
+    }
+    else
+    {
+        if (rows_frame == std::string::npos)
+        {
+            rows_frame = batch.size();
+            put_frame_header(batch, {opcode_t::rows, request_id, 0});
+        }
+        put_le(batch, static_cast<uint16_t>(nof_cols));
+        for (size_t i = 0; i < nof_cols; ++i)
+        {
+            batch.push_back(static_cast<char>(cols[i].type));
+            if (cols[i].type == column_type_t::integer)
+                put_le(batch, cols[i].integer);
+            else if (cols[i].type == column_type_t::text)
+            {
+                put_le(batch, static_cast<uint32_t>(cols[i].text.size()));
+                batch += cols[i].text;
+            }
+        }
+    }
+    if (batch.size() >= REPLY_BATCH_SIZE)
+        flush();
+}
+
+/**
+ * @brief Patches the payload length of the open ROWS frame
+ */
+void reply_writer::close_rows_frame()
+{
+    if (rows_frame == std::string::npos)
+        return;
+    std::string length;
+    put_le(length, static_cast<uint32_t>(batch.size() - rows_frame - FRAME_HEADER_SIZE));
+    batch.replace(rows_frame + 1 + sizeof(uint32_t), length.size(), length);
+    rows_frame = std::string::npos;
+}
+
+/**
+ * @brief Starts a text line by the request id if the client tagged the request
+ */
+void reply_writer::put_id_prefix()
+{
+    if (!echo_id)
+        return;
+    batch.push_back('#');
+    batch += std::to_string(request_id);
+    batch.push_back(' ');
+}
+
+/**
+ * @brief Passes the encoded batch to the foreign callback
+ * @param last the batch ends the reply
+ */
+void reply_writer::flush(bool last)
+{
+    phase_timer timer(kind, latency_phase_t::serialize);
+    close_rows_frame();
+    if (batch.empty())
+        return;
+    foreign_callback(handle, reply_batch_t{std::move(batch), request_id, first_batch, last, kind, {}});
+    batch.clear();
+    first_batch = false;
+}
+
+/**
+ * @brief Ends the reply successfully
+ * @param note optional text to pass along with the acknowledgement
+ */
+void reply_writer::ok(std::string_view note)
+{
+    if (protocol == protocol_t::text)
+    {
+        put_id_prefix();
+        batch += "OK";
+        if (!note.empty())
+            batch += std::string(", ") + std::string(note);
+        batch.push_back(END_OF_CHUNK);
+        batch.push_back(END_OF_REPLY);
+    }
+    else
+    {
+        close_rows_frame();
+        batch += make_frame(opcode_t::ok, request_id, note);
+    }
+    flush(true);
+}
+
+/**
+ * @brief Ends the reply with an error
+ * @param msg error message
+ */
+void reply_writer::error(std::string_view msg)
+{
+    if (protocol == protocol_t::text)
+    {
+        put_id_prefix();
+        batch += "Eror: ";
+        batch += msg;
+        batch.push_back(END_OF_CHUNK);
+        batch.push_back(END_OF_REPLY);
+    }
+    else
+    {
+        close_rows_frame();
+        batch += make_frame(opcode_t::error, request_id, msg);
+    }
+    flush(true);
+}
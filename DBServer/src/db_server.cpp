@@ -6,6 +6,9 @@
 
 #include "db_command.h"
 #include "db_server.h"
+#include "logger.h"
+#include "trace.h"
+#include "probes.h"
 #include "sqlite3.h"
 #include <string>
 #include <iostream>
@@ -14,80 +17,551 @@
 #include <stdexcept>
 #include <cassert>
 #include <filesystem>
+#include <optional>
+#include <charconv>
+#include <cctype>
+#include <vector>
+#include <ctime>
+#include <algorithm>
 
 /**
  * @brief Throws exception on sqlite error code
  * @param code error code
  * @param msg error message
  */
-void sqlite_throw(int code, const char *msg = "")
+void sqlite_throw(int code, const char *msg)
 {
     throw std::runtime_error{
         std::string("SQL Method failed: ") + std::string(sqlite3_errstr(code)) + " " + std::string(msg)};
 }
 
 /**
- * @brief Callback function, called from sqlite3_exec for each result row
- * @param db_server pointer to sqlite3 object
- * @param nof_cols number of cols in result
- * @param cols_of_string results for each column
- * @param col_names column names
- * @return
+ * @brief Executes SQL request, possibly of several statements,
+ *        and passes each result row to the reply writer
+ * @param request SQL request
+ * @param errmsg error message output
+ * @return sqlite error code
  */
-int db_callback(void *db_server, int nof_cols, char **cols_of_string,
-                [[maybe_unused]] char **col_names)
+int db_t::run_request(const std::string &request, std::string &errmsg)
 {
-    std::string res;
-    for (int i = 0; i < nof_cols; ++i)
+    std::vector<column_t> cols;
+    const char *sql = request.c_str();
+    while (*sql)
     {
-        res += (cols_of_string[i] == NULL ? std ::string_view("") : std::string_view(cols_of_string[i]));
-        res += (i == nof_cols - 1) ? "" : ",";
+        sqlite3_stmt *stmt = NULL;
+        auto ec = sqlite3_prepare_v2(pdb, sql, -1, &stmt, &sql);
+        if (ec)
+        {
+            errmsg = sqlite3_errmsg(pdb);
+            return ec;
+        }
+        if (!stmt) // whitespace or comment
+            continue;
+        JOIN_SERVER_PROBE(sql_start, sqlite3_sql(stmt));
+        while ((ec = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            cols.resize(sqlite3_column_count(stmt));
+            for (size_t i = 0; i < cols.size(); ++i)
+            {
+                switch (sqlite3_column_type(stmt, i))
+                {
+                case SQLITE_NULL:
+                    cols[i] = column_t();
+                    break;
+                case SQLITE_INTEGER:
+                    cols[i] = column_t(static_cast<int64_t>(sqlite3_column_int64(stmt, i)));
+                    break;
+                default:
+                    cols[i] = column_t(reinterpret_cast<const char *>(sqlite3_column_text(stmt, i)));
+                    break;
+                }
+            }
+            replies.row(cols.data(), cols.size());
+        }
+        if (ec != SQLITE_DONE)
+            errmsg = sqlite3_errmsg(pdb);
+        JOIN_SERVER_PROBE(sql_end, sqlite3_sql(stmt), ec);
+        sqlite3_finalize(stmt);
+        if (ec != SQLITE_DONE)
+            return ec;
     }
-    res.append(std::string(1, END_OF_CHUNK));
+    return SQLITE_OK;
+}
+
+/**
+ * @brief CPU time of the calling thread
+ * @return nanoseconds
+ */
+static uint64_t thread_cpu_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+/**
+ * @brief Adds the CPU time of the calling thread spent within its scope to a counter
+ */
+class cpu_time_scope
+{
+private:
+    uint64_t &total;
+    uint64_t start = thread_cpu_ns();
+
+public:
+    explicit cpu_time_scope(uint64_t &_total) : total(_total) {}
+    cpu_time_scope(const cpu_time_scope &) = delete;
+    cpu_time_scope &operator=(const cpu_time_scope &) = delete;
+    ~cpu_time_scope() { total += thread_cpu_ns() - start; }
+};
+
+/**
+ * @brief Reports the resources used by the db
+ * @return usage
+ */
+db_usage_t db_t::get_usage()
+{
+    db_usage_t usage{commands, cpu_ns, replies.get_rows()};
+    int highwater = 0;
+    sqlite3_db_status(pdb, SQLITE_DBSTATUS_CACHE_USED, &usage.cache_bytes, &highwater, 0);
+    sqlite3_db_status(pdb, SQLITE_DBSTATUS_SCHEMA_USED, &usage.schema_bytes, &highwater, 0);
+    sqlite3_db_status(pdb, SQLITE_DBSTATUS_STMT_USED, &usage.stmt_bytes, &highwater, 0);
+    return usage;
+}
 
-    auto pdb = static_cast<db_t *>(db_server);
-    pdb->foreign_callback(pdb->handle, res);
+/**
+ * @brief Keeps statements of the current command taking longer than
+ *        the clock resolution of SQLite, the longest ones if there are many
+ * @param type SQLITE_TRACE_PROFILE
+ * @param ctx the db
+ * @param p the statement
+ * @param x nanoseconds the statement took
+ * @return 0
+ */
+int db_t::profile_callback(unsigned type, void *ctx, void *p, void *x)
+{
+    auto db = static_cast<db_t *>(ctx);
+    auto ns = *static_cast<int64_t *>(x);
+    if (type != SQLITE_TRACE_PROFILE || ns <= 0)
+        return 0;
+    auto &statements = db->profiled;
+    if (statements.size() == MAX_PROFILED_STATEMENTS)
+    {
+        auto fastest = std::min_element(statements.begin(), statements.end(),
+                                        [](auto &a, auto &b)
+                                        { return a.ns < b.ns; });
+        if (fastest->ns >= ns)
+            return 0;
+        statements.erase(fastest);
+    }
+    statements.push_back({sqlite3_sql(static_cast<sqlite3_stmt *>(p)), ns});
     return 0;
 }
 
 /**
- * @brief Execute SQL request
+ * @brief Runs a query answering a single text or integer column,
+ *        bypassing the reply writer
+ * @param sql the query
+ * @param separator put between the rows
+ * @return the rows, the error message if the query fails
+ */
+std::string db_t::query_text(const std::string &sql, std::string_view separator)
+{
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(pdb, sql.c_str(), -1, &stmt, NULL) != SQLITE_OK)
+        return sqlite3_errmsg(pdb);
+    std::string text;
+    int last = sqlite3_column_count(stmt) - 1;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        if (!text.empty())
+            text += separator;
+        auto column = reinterpret_cast<const char *>(sqlite3_column_text(stmt, last));
+        text += column ? column : "NULL";
+    }
+    sqlite3_finalize(stmt);
+    return text;
+}
+
+/**
+ * @brief Logs a slow command: its statements with their query plans,
+ *        the rows it replied with, the sizes of the tables and the database
+ * @param cmd the command
+ * @param elapsed the time it took
+ * @param rows result rows
+ */
+void db_t::log_slow_command(const std::string &cmd, std::chrono::nanoseconds elapsed, uint64_t rows)
+{
+    // the queries below are profiled as well
+    auto statements = std::move(profiled);
+    profiled.clear();
+    // table sizes are taken from the summaries, counting rows would scan the tables
+    auto table_rows = [](const table_state &state)
+    {
+        return state.stale || !state.sketch_usable ? std::string("unknown") : std::to_string(state.sketch.rows);
+    };
+    LOG_WARNING("slow command ", db_path, ": ", std::string_view(cmd).substr(0, 80),
+                " took ", elapsed.count() / 1000, " us, ", rows, " rows, tables A ",
+                table_rows(tables[0]), " rows, B ", table_rows(tables[1]),
+                " rows, database ", query_text("SELECT page_count * page_size FROM pragma_page_count, pragma_page_size;"),
+                " bytes");
+    for (auto &statement : statements)
+    {
+        LOG_WARNING("slow command ", db_path, ": ", statement.ns / 1000, " us in ",
+                    std::string_view(statement.sql).substr(0, 160));
+        LOG_WARNING("slow command ", db_path, ": plan ",
+                    query_text("EXPLAIN QUERY PLAN " + statement.sql, " | "));
+    }
+}
+
+/**
+ * @brief Execute SQL request, logs it if it takes slow_threshold or longer
+ * @param cmd SQL request
+ * @param request_id id of the request, echoed in binary replies
+ * @param echo_id echo the request id in text replies as well
+ */
+void db_t::execute_cmd(const std::string cmd, uint32_t request_id, bool echo_id)
+{
+    trace_span span("execute_cmd", "request_id", request_id);
+    ++commands;
+    cpu_time_scope cpu(cpu_ns);
+    auto start = std::chrono::steady_clock::now();
+    auto rows = replies.get_rows();
+    profiled.clear();
+    dispatch_cmd(cmd, request_id, echo_id);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    if (slow_threshold.count() && elapsed >= slow_threshold)
+        log_slow_command(cmd, elapsed, replies.get_rows() - rows);
+}
+
+/**
+ * @brief Parses a command and answers it the way its kind and the tables allow
  * @param cmd SQL request
+ * @param request_id id of the request, echoed in binary replies
+ * @param echo_id echo the request id in text replies as well
  */
-void db_t::execute_cmd(const std::string cmd)
+void db_t::dispatch_cmd(const std::string &cmd, uint32_t request_id, bool echo_id)
 {
-    char *errmsg = NULL;
-    command new_command(cmd);
-    std::string request = new_command.request;
-    auto ec = sqlite3_exec(pdb, request.c_str(),
-                           db_callback /*printer*/, (void *)this, &errmsg);
+    std::optional<command> parsed;
+    replies.begin(request_id, echo_id);
+    phase_timer timer(command_kind_t::other, latency_phase_t::parse);
+    try
+    {
+        parsed.emplace(cmd);
+    }
+    catch (const std::invalid_argument &e)
+    {
+        // send command syntax error
+        replies.error(e.what());
+        return;
+    }
+    command &new_command = *parsed;
+    timer.set_kind(kind_of(new_command.get_key()));
+    timer.next(latency_phase_t::execute);
+    replies.set_kind(kind_of(new_command.get_key()));
+    if (new_command.get_modifiers().approx)
+    {
+        reply_approx(new_command);
+        return;
+    }
+    if (new_command.get_key() == "MER")
+    {
+        reply_merge(new_command);
+        return;
+    }
+    if (new_command.get_key() == "BIT")
+    {
+        switch_bitmap(new_command);
+        return;
+    }
+    if (new_command.get_key() == "ACK")
+    {
+        switch_acks(new_command);
+        return;
+    }
+    if (new_command.get_key() == "FLU")
+    {
+        reply_acks();
+        return;
+    }
+    if (new_command.get_key() == "INT" || new_command.get_key() == "SYM")
+    {
+        int small = -1;
+        if (bitmaps_usable())
+        {
+            reply_bitmap(new_command);
+            return;
+        }
+        if ((small = skewed_side()) >= 0)
+        {
+            if (new_command.get_key() == "INT")
+                reply_probe(new_command, small);
+            else
+                reply_merge(new_command, true);
+            return;
+        }
+    }
+    std::string errmsg;
+    auto ec = run_request(new_command.request, errmsg);
+    if (ec == SQLITE_OK)
+        maintain_tables(new_command);
+    if (acks.quiet && (new_command.get_key() == "INS" || new_command.get_key() == "TRU"))
+    {
+        coalesce_ack(ec, errmsg);
+        return;
+    }
     if (ec)
     {
         // send DB error
-        std::string res = "Eror: code = " + std::to_string(ec) + " ";
-        if (errmsg != NULL)
+        replies.error("code = " + std::to_string(ec) + " " + errmsg);
+        return;
+    }
+    // every binary reply ends with OK or ERROR, whatever the command's flag
+    if (new_command.send_asknolegement() || replies.get_protocol() == protocol_t::binary)
+        replies.ok();
+}
+
+/**
+ * @brief Switches acknowledgement coalescing, the reply carries
+ *        acknowledgements coalesced before the switch
+ * @param cmd ACK QUIET [batch size] | ACK EACH command
+ */
+void db_t::switch_acks(const command &cmd)
+{
+    auto &args = cmd.get_args();
+    uint64_t batch_size = 0;
+    bool valid = args.size() == 1 && (args[0] == "QUIET" || args[0] == "EACH");
+    if (args.size() == 2 && args[0] == "QUIET")
+    {
+        auto [ptr, ec] = std::from_chars(args[1].data(), args[1].data() + args[1].size(), batch_size);
+        valid = (ec == std::errc() && ptr == args[1].data() + args[1].size());
+    }
+    if (!valid)
+    {
+        replies.error("The use is: ACK QUIET [batch size] | ACK EACH");
+        return;
+    }
+    reply_acks();
+    acks.quiet = (args[0] == "QUIET");
+    acks.batch_size = batch_size;
+}
+
+/**
+ * @brief Accounts the result of a quietly acknowledged command,
+ *        replies once the batch is full
+ * @param ec sqlite error code of the command
+ * @param errmsg error message
+ */
+void db_t::coalesce_ack(int ec, const std::string &errmsg)
+{
+    ++acks.seq;
+    if (ec == SQLITE_OK)
+        ++acks.acked;
+    else if (++acks.failed <= ack_coalescer::max_errors)
+        acks.errors.emplace_back(acks.seq, "code = " + std::to_string(ec) + " " + errmsg);
+    if (acks.batch_size && acks.seq >= acks.batch_size)
+        reply_acks();
+}
+
+/**
+ * @brief Replies with coalesced acknowledgements: "acked,<n>", "failed,<n>"
+ *        and a "<sequence number>,<error>" row per failed command
+ */
+void db_t::reply_acks()
+{
+    if (acks.seq)
+    {
+        replies.row({"acked", static_cast<int64_t>(acks.acked)});
+        replies.row({"failed", static_cast<int64_t>(acks.failed)});
+        for (auto &[seq, msg] : acks.errors)
+            replies.row({static_cast<int64_t>(seq), std::string_view(msg)});
+    }
+    acks.reset();
+    replies.ok();
+}
+
+/**
+ * @brief Mirrors a successful insert
+ * @param id inserted id
+ */
+void table_state::add(int64_t id)
+{
+    sketch.add(id);
+    bloom.add(id_hash(id));
+    if (bloom_growing)
+        growing.add(id_hash(id));
+    if (!bitmap_enabled)
+        return;
+    if (id >= 0 && id <= UINT32_MAX)
+        bitmap.add(static_cast<uint32_t>(id));
+    else
+        bitmap_usable = false;
+}
+
+/**
+ * @brief Mirrors table truncation
+ */
+void table_state::clear()
+{
+    stale = false;
+    sketch_usable = true;
+    sketch.clear();
+    bloom.reset(blocked_bloom::min_capacity);
+    growing = blocked_bloom();
+    bloom_growing = false;
+    grown_to.reset();
+    bitmap.clear();
+    bitmap_usable = true;
+}
+
+/**
+ * @brief Finds the summaries of a table
+ * @param table table name as given in command, case-insensitive
+ * @return the summaries or nullptr for unknown tables
+ */
+table_state *db_t::table_of(std::string_view table)
+{
+    if (table.size() != 1)
+        return nullptr;
+    switch (std::toupper(static_cast<unsigned char>(table[0])))
+    {
+    case 'A':
+        return &tables[0];
+    case 'B':
+        return &tables[1];
+    default:
+        return nullptr;
+    }
+}
+
+/**
+ * @brief Refills table summaries from the table contents
+ * @param state the summaries to refill
+ */
+void db_t::rebuild_table(table_state &state)
+{
+    auto rows = state.sketch.rows;
+    state.clear();
+    state.bloom.reset(2 * rows);
+    std::string request = std::string("SELECT id FROM ") + table_names[&state - tables.data()] + ";";
+    sqlite3_stmt *stmt = NULL;
+    auto ec = sqlite3_prepare_v2(pdb, request.c_str(), -1, &stmt, NULL);
+    if (ec)
+        sqlite_throw(ec, sqlite3_errmsg(pdb));
+    while ((ec = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        // the schema takes ids of any type, only integer ones can be summarized
+        if (sqlite3_column_type(stmt, 0) == SQLITE_INTEGER)
+            state.add(sqlite3_column_int64(stmt, 0));
+        else
+            state.sketch_usable = state.bitmap_usable = false;
+    }
+    sqlite3_finalize(stmt);
+    state.stale = false;
+    if (ec != SQLITE_DONE)
+        sqlite_throw(ec, sqlite3_errmsg(pdb));
+}
+
+/**
+ * @brief Steps the replacement of an overloaded Bloom filter: the next
+ *        BLOOM_GROW_STEP ids of an ordered scan are added to the growing filter,
+ *        which takes over at the end of the scan. Till then the overloaded one
+ *        answers with more false positives, but without false negatives
+ * @param state the summaries of the table
+ */
+void db_t::grow_bloom(table_state &state)
+{
+    if (!state.bloom_growing)
+    {
+        state.growing.reset(2 * state.sketch.rows);
+        state.grown_to.reset();
+        state.bloom_growing = true;
+    }
+    std::string request = std::string("SELECT id FROM ") + table_names[&state - tables.data()] +
+                          (state.grown_to ? " WHERE id > ?" : "") +
+                          " ORDER BY id LIMIT " + std::to_string(BLOOM_GROW_STEP) + ";";
+    sqlite3_stmt *stmt = NULL;
+    auto ec = sqlite3_prepare_v2(pdb, request.c_str(), -1, &stmt, NULL);
+    if (ec == SQLITE_OK && state.grown_to)
+        sqlite3_bind_int64(stmt, 1, *state.grown_to);
+    int nof_ids = 0;
+    if (ec == SQLITE_OK)
+        while ((ec = sqlite3_step(stmt)) == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_INTEGER)
         {
-            res.append(std::string(errmsg));
-            sqlite3_free(errmsg);
+            state.grown_to = sqlite3_column_int64(stmt, 0);
+            state.growing.add(id_hash(*state.grown_to));
+            ++nof_ids;
         }
+    sqlite3_finalize(stmt);
+    if (ec != SQLITE_DONE)
+    {
+        // an error or an id other than integer: the whole table is rebuilt on demand
+        state.stale = true;
+        return;
+    }
+    if (nof_ids < BLOOM_GROW_STEP)
+    {
+        state.bloom = std::move(state.growing);
+        state.growing = blocked_bloom();
+        state.bloom_growing = false;
+    }
+}
+
+/**
+ * @brief Rebuilds summaries which missed an insert
+ */
+void db_t::refresh_stale_tables()
+{
+    for (auto &state : tables)
+        if (state.stale)
+            rebuild_table(state);
+}
 
-        foreign_callback(handle, res + std::string(1, END_OF_CHUNK) + std::string(1, END_OF_REPLY));
+/**
+ * @brief Mirrors a successfully executed command in table summaries
+ * @param cmd executed command
+ */
+void db_t::maintain_tables(const command &cmd)
+{
+    auto key = cmd.get_key();
+    auto &args = cmd.get_args();
+    if (key == "CRE")
+    {
+        for (auto &state : tables)
+            state.clear();
         return;
     }
-    if (new_command.send_asknolegement())
+    if (args.empty())
+        return;
+    auto state = table_of(args[0]);
+    if (!state)
+        return;
+    if (key == "TRU")
+        state->clear();
+    else if (key == "INS")
     {
-        foreign_callback(handle, std::string("OK") + std::string(1, END_OF_CHUNK) + std::string(1, END_OF_REPLY));
+        // the id is substituted into SQL as is, so it may be an expression
+        int64_t id = 0;
+        auto &word = args.size() > 1 ? args[1] : args[0];
+        auto [ptr, ec] = std::from_chars(word.data(), word.data() + word.size(), id);
+        if (args.size() > 1 && ec == std::errc() && ptr == word.data() + word.size())
+            state->add(id);
+        else
+            state->stale = true;
+        if (!state->stale && state->bloom.overloaded())
+            grow_bloom(*state);
     }
 }
 
 /**
  * @brief A db object
  * @param _db_directory db directory
- * @param _foreign_callback the function to be called for each resul row from db_callback
+ * @param _foreign_callback the function to be called for each batch of encoded result rows
  * @param _handle some external id, to store in the db object
+ * @throw std::runtime_error if the database can not be opened
  */
 db_t::db_t(std::string _db_directory, foreign_callback_t _foreign_callback, void *_handle)
-    : handle(_handle), foreign_callback(_foreign_callback)
+    : handle(_handle), replies(_foreign_callback, _handle)
 {
     std::string db_directory;
     if (!_db_directory.size())
@@ -98,9 +572,13 @@ db_t::db_t(std::string _db_directory, foreign_callback_t _foreign_callback, void
     auto ec = sqlite3_open(db_path.c_str(), &pdb);
     if (ec)
     {
-        std::cerr << "Error while opening db" << '\n';
-        quick_exit(1);
+        // e.g. out of file descriptors: the client is refused, the server goes on
+        std::string errmsg = pdb ? sqlite3_errmsg(pdb) : "";
+        sqlite3_close(pdb);
+        sqlite_throw(ec, (db_path + ": " + errmsg).c_str());
     }
+    if (slow_threshold.count())
+        sqlite3_trace_v2(pdb, SQLITE_TRACE_PROFILE, profile_callback, this);
 }
 
 /**
@@ -123,8 +601,6 @@ void db_t::clean_directory(std::string _db_directory)
         db_directory = !_db_directory.size() ? default_db_directory : _db_directory;
 
     using namespace std::filesystem;
-    auto res = system("clear");
-    (void)res;
 
     if (!exists(db_directory))
     {
@@ -0,0 +1,331 @@
+/**
+ * @brief db_set_operations.cpp
+ * Set operations answered by db_t itself rather than by a single SQL request:
+ * sketch estimates, ordered merges, bitmap and Bloom-filtered joins
+ *
+ */
+
+#include "db_command.h"
+#include "db_server.h"
+#include "sqlite3.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+/**
+ * @brief Replies to APPROX modifier with cardinality estimated from sketches,
+ *        the tables themselves are read only to rebuild stale sketches
+ * @param cmd the command with APPROX modifier
+ */
+void db_t::reply_approx(const command &cmd)
+{
+    try
+    {
+        refresh_stale_tables();
+        if (!tables[0].sketch_usable || !tables[1].sketch_usable)
+        {
+            replies.error("APPROX needs integer ids, a table holds other ones");
+            return;
+        }
+        auto &a = tables[0].sketch, &b = tables[1].sketch;
+        auto est = estimate_set_operations(a, b);
+        if (cmd.get_key() == "MER")
+        {
+            auto a_only = std::max(0.0, a.rows - est.intersection);
+            auto b_only = std::max(0.0, b.rows - est.intersection);
+            std::array values{est.intersection, a_only, b_only};
+            for (size_t tag = 0; tag < MERGE_TAGS.size(); ++tag)
+                replies.row({MERGE_TAGS[tag], static_cast<int64_t>(std::llround(values[tag]))});
+        }
+        else
+        {
+            auto value = cmd.get_key() == "INT" ? est.intersection : est.symmetric_difference;
+            replies.row({static_cast<int64_t>(std::llround(value))});
+        }
+        replies.ok();
+    }
+    catch (const std::runtime_error &e)
+    {
+        replies.error(e.what());
+    }
+}
+
+/**
+ * @brief Ordered cursor over one side of a merge
+ */
+struct merge_cursor
+{
+    std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)> stmt{nullptr, sqlite3_finalize};
+    bool valid = false;
+    int64_t id = 0;
+
+    void open(sqlite3 *pdb, const char *request, const char **tail = NULL)
+    {
+        sqlite3_stmt *p = NULL;
+        auto ec = sqlite3_prepare_v2(pdb, request, -1, &p, tail);
+        stmt.reset(p);
+        if (ec)
+            sqlite_throw(ec, sqlite3_errmsg(pdb));
+        step();
+    }
+    void step()
+    {
+        auto ec = sqlite3_step(stmt.get());
+        valid = (ec == SQLITE_ROW);
+        if (valid)
+            id = sqlite3_column_int64(stmt.get(), 0);
+        else if (ec != SQLITE_DONE)
+            sqlite_throw(ec, sqlite3_errmsg(sqlite3_db_handle(stmt.get())));
+    }
+    const char *name()
+    {
+        return valid ? reinterpret_cast<const char *>(sqlite3_column_text(stmt.get(), 1)) : NULL;
+    }
+};
+
+/**
+ * @brief Replies to MERGE: a single full outer merge of A and B in id order.
+ *        Both ordered index scans are walked once, each row is tagged
+ *        "both", "A only" or "B only"; with COUNT only tag totals are sent.
+ *        With unmatched_only the merge answers SYMMETRIC_DIFFERENCE instead:
+ *        untagged rows present in one table only, without a single index probe
+ * @param cmd the command, MERGE request holds the two cursor queries
+ * @param unmatched_only skip ids present in both tables
+ */
+void db_t::reply_merge(const command &cmd, bool unmatched_only)
+{
+    auto &mods = cmd.get_modifiers();
+    try
+    {
+        merge_cursor a, b;
+        if (unmatched_only)
+        {
+            // cursors are stepped lazily, LIMIT is applied to the merged rows only
+            a.open(pdb, ordered_scan_request(table_names[0], mods, !mods.count).c_str());
+            b.open(pdb, ordered_scan_request(table_names[1], mods, !mods.count).c_str());
+        }
+        else
+        {
+            const char *tail = NULL;
+            a.open(pdb, cmd.request.c_str(), &tail);
+            b.open(pdb, tail);
+        }
+
+        uint64_t nof_rows = 0, limit = mods.limit.value_or(UINT64_MAX);
+        std::array<uint64_t, MERGE_TAGS.size()> totals{};
+        while ((a.valid || b.valid) && nof_rows < limit)
+        {
+            bool from_a = a.valid && (!b.valid || a.id <= b.id);
+            bool from_b = b.valid && (!a.valid || b.id <= a.id);
+            auto tag = from_a && from_b ? 0 : from_a ? 1 : 2;
+            if (!unmatched_only || tag)
+            {
+                ++totals[tag];
+                ++nof_rows;
+                if (!mods.count)
+                {
+                    std::array<column_t, 4> cols{from_a ? a.id : b.id,
+                                                 from_a ? a.name() : NULL,
+                                                 from_b ? b.name() : NULL,
+                                                 MERGE_TAGS[tag]};
+                    replies.row(cols.data(), unmatched_only ? 3 : cols.size());
+                }
+            }
+            if (from_a)
+                a.step();
+            if (from_b)
+                b.step();
+        }
+        if (mods.count && unmatched_only)
+            replies.row({static_cast<int64_t>(nof_rows)});
+        else if (mods.count)
+            for (size_t tag = 0; tag < MERGE_TAGS.size(); ++tag)
+                replies.row({MERGE_TAGS[tag], static_cast<int64_t>(totals[tag])});
+        replies.ok();
+    }
+    catch (const std::runtime_error &e)
+    {
+        replies.error(e.what());
+    }
+}
+
+/**
+ * @brief Switches the id bitmap of a table, building it from the table contents
+ * @param cmd BITMAP <table> ON|OFF command
+ */
+void db_t::switch_bitmap(const command &cmd)
+{
+    auto &args = cmd.get_args();
+    try
+    {
+        auto state = args.size() == 2 ? table_of(args[0]) : nullptr;
+        if (!state || (args[1] != "ON" && args[1] != "OFF"))
+            throw std::invalid_argument("The use is: BITMAP A|B ON|OFF");
+        state->bitmap_enabled = (args[1] == "ON");
+        // the bitmap is filled from the table, switching it off needs no scan
+        if (state->bitmap_enabled)
+            rebuild_table(*state);
+        else
+            state->bitmap = {};
+        replies.ok(state->bitmap_enabled && !state->bitmap_usable
+                       ? "ids outside of bitmap range, the table is joined by SQL"
+                       : "");
+    }
+    catch (const std::exception &e)
+    {
+        replies.error(e.what());
+    }
+}
+
+/**
+ * @brief Checks whether both tables are indexed by usable bitmaps
+ * @return true if set operations can be done over bitmaps
+ */
+bool db_t::bitmaps_usable()
+{
+    if (!tables[0].bitmap_enabled || !tables[1].bitmap_enabled)
+        return false;
+    try
+    {
+        refresh_stale_tables();
+    }
+    catch (const std::runtime_error &)
+    {
+        return false;
+    }
+    return tables[0].bitmap_usable && tables[1].bitmap_usable;
+}
+
+/**
+ * @brief Point lookup of a row by id
+ */
+struct name_lookup
+{
+    std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)> stmt{nullptr, sqlite3_finalize};
+
+    name_lookup(sqlite3 *pdb, const char *table)
+    {
+        std::string request = std::string("SELECT name FROM ") + table + " WHERE id = ?;";
+        sqlite3_stmt *p = NULL;
+        auto ec = sqlite3_prepare_v2(pdb, request.c_str(), -1, &p, NULL);
+        stmt.reset(p);
+        if (ec)
+            sqlite_throw(ec, sqlite3_errmsg(pdb));
+    }
+    bool find(int64_t id)
+    {
+        sqlite3_reset(stmt.get());
+        sqlite3_bind_int64(stmt.get(), 1, id);
+        auto ec = sqlite3_step(stmt.get());
+        if (ec != SQLITE_ROW && ec != SQLITE_DONE)
+            sqlite_throw(ec, sqlite3_errmsg(sqlite3_db_handle(stmt.get())));
+        return ec == SQLITE_ROW;
+    }
+    const char *name() { return reinterpret_cast<const char *>(sqlite3_column_text(stmt.get(), 0)); }
+    const char *operator()(int64_t id) { return find(id) ? name() : NULL; }
+};
+
+/**
+ * @brief Replies to INTERSECTION / SYMMETRIC_DIFFERENCE over id bitmaps:
+ *        the id set is an AND / XOR of the tables' bitmaps,
+ *        names are fetched by point lookups for surviving ids only
+ * @param cmd the command
+ */
+void db_t::reply_bitmap(const command &cmd)
+{
+    auto &mods = cmd.get_modifiers();
+    bool is_xor = cmd.get_key() == "SYM";
+    // the id window clipped to the bitmap domain
+    int64_t from = std::max<int64_t>(mods.id_from.value_or(0), 0);
+    int64_t to = std::min<int64_t>(mods.id_to.value_or(UINT32_MAX), UINT32_MAX);
+    uint64_t limit = mods.limit.value_or(UINT64_MAX);
+    try
+    {
+        roaring_bitmap ids;
+        if (from <= to)
+            ids = is_xor ? roaring_bitmap::symmetric_difference(tables[0].bitmap, tables[1].bitmap, from, to)
+                         : roaring_bitmap::intersection(tables[0].bitmap, tables[1].bitmap, from, to);
+        if (mods.count)
+            replies.row({static_cast<int64_t>(from <= to ? std::min(ids.cardinality(from, to), limit) : 0)});
+        else if (from <= to)
+        {
+            name_lookup a_name(pdb, table_names[0]), b_name(pdb, table_names[1]);
+            uint64_t nof_rows = 0;
+            ids.for_each(from, to, [&](uint32_t id)
+                         {
+                if (nof_rows++ >= limit)
+                    return false;
+                bool in_a = !is_xor || tables[0].bitmap.contains(id);
+                bool in_b = !is_xor || !in_a;
+                replies.row({int64_t(id),
+                             in_a ? a_name(id) : NULL,
+                             in_b ? b_name(id) : NULL});
+                return true; });
+        }
+        replies.ok();
+    }
+    catch (const std::runtime_error &e)
+    {
+        replies.error(e.what());
+    }
+}
+
+/**
+ * @brief Checks whether one table is so much smaller than the other
+ *        that probing the larger one per row of the smaller one beats a join.
+ *        Stale tables are not rebuilt here, a full scan would stall the query
+ * @return index of the smaller table or -1 if the sizes are comparable or unknown
+ */
+int db_t::skewed_side()
+{
+    for (auto &state : tables)
+        if (state.stale || !state.sketch_usable)
+            return -1;
+    auto na = tables[0].sketch.rows, nb = tables[1].sketch.rows;
+    if (std::max(na, nb) < SKEW_MIN_ROWS || std::max(na, nb) < SKEW_RATIO * std::min(na, nb))
+        return -1;
+    return na < nb ? 0 : 1;
+}
+
+/**
+ * @brief Replies to INTERSECTION of very unequal tables:
+ *        the smaller table is scanned in id order and the larger one is probed
+ *        only for ids its Bloom filter may contain
+ * @param cmd the command
+ * @param small index of the smaller table
+ */
+void db_t::reply_probe(const command &cmd, int small)
+{
+    auto &mods = cmd.get_modifiers();
+    int large = 1 - small;
+    try
+    {
+        merge_cursor scan;
+        scan.open(pdb, ordered_scan_request(table_names[small], mods, !mods.count).c_str());
+        name_lookup probe(pdb, table_names[large]);
+        auto &bloom = tables[large].bloom;
+
+        uint64_t nof_rows = 0, limit = mods.limit.value_or(UINT64_MAX);
+        for (; scan.valid && nof_rows < limit; scan.step())
+        {
+            if (!bloom.may_contain(id_hash(scan.id)) || !probe.find(scan.id))
+                continue;
+            ++nof_rows;
+            if (mods.count)
+                continue;
+            replies.row({scan.id,
+                         small == 0 ? scan.name() : probe.name(),
+                         small == 0 ? probe.name() : scan.name()});
+        }
+        if (mods.count)
+            replies.row({static_cast<int64_t>(nof_rows)});
+        replies.ok();
+    }
+    catch (const std::runtime_error &e)
+    {
+        replies.error(e.what());
+    }
+}
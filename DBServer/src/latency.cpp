@@ -0,0 +1,156 @@
+/**
+ * @brief latency.cpp
+ * Latency histograms per command kind and phase of its processing
+ *
+ */
+#include "latency.h"
+#include <algorithm>
+#include <bit>
+
+/**
+ * @brief Finds the bucket of a value
+ * @param ns value in nanoseconds
+ * @return bucket index
+ */
+size_t latency_histogram::bucket_of(uint64_t ns)
+{
+    // the shift keeps the value within [LATENCY_SUB_BUCKETS, 2 * LATENCY_SUB_BUCKETS)
+    size_t shift = std::max<size_t>(std::bit_width(ns), 5) - 5;
+    return shift * LATENCY_SUB_BUCKETS + static_cast<size_t>(ns >> shift);
+}
+
+/**
+ * @brief Finds the value a bucket stands for, the middle of its range
+ * @param bucket bucket index
+ * @return value in nanoseconds
+ */
+uint64_t latency_histogram::value_of(size_t bucket)
+{
+    size_t shift = bucket < LATENCY_SUB_BUCKETS ? 0 : bucket / LATENCY_SUB_BUCKETS - 1;
+    uint64_t lowest = static_cast<uint64_t>(bucket - shift * LATENCY_SUB_BUCKETS) << shift;
+    return lowest + ((uint64_t(1) << shift) - 1) / 2;
+}
+
+/**
+ * @brief Copies the counts
+ * @param out the snapshot to copy to
+ */
+void latency_histogram::snapshot(latency_snapshot_t &out) const
+{
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+        out.counts[i] = counts[i].load(std::memory_order_relaxed);
+    out.total = total.load(std::memory_order_relaxed);
+    out.max = max.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Zeroes the counts, races with recording lose a few samples only
+ */
+void latency_histogram::reset()
+{
+    for (auto &count : counts)
+        count.store(0, std::memory_order_relaxed);
+    total.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Adds the counts of another snapshot
+ * @param other the snapshot to add
+ */
+void latency_snapshot_t::merge(const latency_snapshot_t &other)
+{
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+        counts[i] += other.counts[i];
+    total += other.total;
+    max = std::max(max, other.max);
+}
+
+/**
+ * @brief Finds a percentile
+ * @param p percentile, 0 to 100
+ * @return value in nanoseconds, 0 if there are no samples
+ */
+uint64_t latency_snapshot_t::percentile(double p) const
+{
+    uint64_t seen = 0;
+    uint64_t rank = static_cast<uint64_t>(p / 100 * static_cast<double>(total));
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+    {
+        seen += counts[i];
+        if (seen > rank)
+            return std::min(latency_histogram::value_of(i), max);
+    }
+    return max;
+}
+
+/**
+ * @brief Finds the smallest value recorded
+ * @return value in nanoseconds, 0 if there are no samples
+ */
+uint64_t latency_snapshot_t::min() const
+{
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+        if (counts[i])
+            return latency_histogram::value_of(i);
+    return 0;
+}
+
+/**
+ * @brief Finds the histograms of the calling thread, registers them on the first call
+ * @return the histograms
+ */
+latency_stats_t &latency_registry::local_stats()
+{
+    thread_local std::shared_ptr<latency_stats_t> local;
+    if (!local)
+    {
+        local = std::make_shared<latency_stats_t>();
+        std::lock_guard lock(stats_mutex);
+        stats.push_back(local);
+    }
+    return *local;
+}
+
+/**
+ * @brief Merges the histograms of all threads for a command kind and phase
+ * @param kind command kind
+ * @param phase phase
+ * @return merged counts
+ */
+latency_snapshot_t latency_registry::snapshot(command_kind_t kind, latency_phase_t phase)
+{
+    latency_snapshot_t merged, one;
+    std::lock_guard lock(stats_mutex);
+    for (auto &thread_stats : stats)
+    {
+        thread_stats->histograms[static_cast<size_t>(kind)][static_cast<size_t>(phase)].snapshot(one);
+        merged.merge(one);
+    }
+    return merged;
+}
+
+/**
+ * @brief Zeroes the histograms of all threads
+ */
+void latency_registry::reset()
+{
+    std::lock_guard lock(stats_mutex);
+    for (auto &thread_stats : stats)
+        for (auto &by_phase : thread_stats->histograms)
+            for (auto &histogram : by_phase)
+                histogram.reset();
+}
+
+/**
+ * @brief Finds the kind of a command by its key
+ * @param key the first three letters of the command
+ * @return command kind
+ */
+command_kind_t kind_of(std::string_view key)
+{
+    static constexpr std::array<std::string_view, static_cast<size_t>(command_kind_t::session)> keys{
+        "CRE", "TRU", "INS", "INT", "SYM", "MER", "BIT", "ACK", "FLU"};
+    auto it = std::find(keys.begin(), keys.end(), key);
+    return it == keys.end() ? command_kind_t::other : static_cast<command_kind_t>(it - keys.begin());
+}
@@ -0,0 +1,122 @@
+/**
+ * @brief logger.cpp
+ * Asynchronous logging of join_server and its db library
+ *
+ */
+#include "logger.h"
+#include <chrono>
+#include <ctime>
+
+/**
+ * @brief Checks the rate limit of a call site
+ * @param reported output parameter to store the number of messages suppressed
+ * since the last one let through
+ * @return true if the message is let through
+ */
+bool log_rate_t::admit(uint32_t &reported)
+{
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+                   .count();
+    if (now != second)
+    {
+        second = now;
+        count = 0;
+    }
+    if (count >= LOG_RATE_PER_SECOND)
+    {
+        ++suppressed;
+        return false;
+    }
+    ++count;
+    reported = suppressed;
+    suppressed = 0;
+    return true;
+}
+
+/**
+ * @brief Finds the ring of the calling thread, registers it on the first call
+ * @return the ring
+ */
+log_ring_t &logger_t::local_ring()
+{
+    thread_local std::shared_ptr<log_ring_t> ring;
+    if (!ring)
+    {
+        ring = std::make_shared<log_ring_t>();
+        std::lock_guard lock(rings_mutex);
+        ring->thread_id = static_cast<uint32_t>(rings.size());
+        rings.push_back(ring);
+    }
+    return *ring;
+}
+
+/**
+ * @brief Starts the drain thread
+ * @param level the lowest level written
+ * @param _out the stream written to
+ */
+void logger_t::start(log_level_t level, FILE *_out)
+{
+    min_level = level;
+    out = _out;
+    if (running.exchange(true))
+        return;
+    drainer = std::thread([this]
+                          { drain_loop(); });
+}
+
+/**
+ * @brief Stops the drain thread, the records already logged are written
+ */
+void logger_t::stop()
+{
+    if (running.exchange(false))
+        drainer.join();
+    drain();
+}
+
+/**
+ * @brief Writes the records of all rings
+ * @return number of records written
+ */
+size_t logger_t::drain()
+{
+    static constexpr const char *level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+    size_t written = 0;
+    std::lock_guard lock(rings_mutex);
+    for (auto &ring : rings)
+    {
+        if (auto dropped = ring->dropped.exchange(0, std::memory_order_relaxed))
+            std::fprintf(out, "WARNING [%u] %llu log messages dropped\n", ring->thread_id,
+                         static_cast<unsigned long long>(dropped));
+        auto tail = ring->tail.load(std::memory_order_relaxed);
+        auto head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail, ++written)
+        {
+            auto &record = ring->records[tail & (LOG_RING_SIZE - 1)];
+            std::time_t seconds = record.time_us / 1000000;
+            std::tm tm;
+            localtime_r(&seconds, &tm);
+            char stamp[32];
+            std::strftime(stamp, sizeof(stamp), "%F %T", &tm);
+            std::fprintf(out, "%s.%03d %s [%u] %.*s\n", stamp, static_cast<int>(record.time_us / 1000 % 1000),
+                         level_names[static_cast<size_t>(record.level)], ring->thread_id,
+                         static_cast<int>(record.length), record.text);
+            ring->tail.store(tail + 1, std::memory_order_release);
+        }
+    }
+    if (written)
+        std::fflush(out);
+    return written;
+}
+
+/**
+ * @brief Drain thread body: drains the rings, naps when they are empty
+ */
+void logger_t::drain_loop()
+{
+    while (running.load(std::memory_order_relaxed))
+        if (!drain())
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+}
@@ -0,0 +1,246 @@
+/**
+ * @brief roaring.cpp
+ * Compressed bitmap of 32-bit ids
+ *
+ */
+#include "roaring.h"
+#include <algorithm>
+#include <bit>
+#include <iterator>
+
+/**
+ * @brief Tests a low 16-bit id against the container
+ * @param low low bits of the id
+ * @return true if present
+ */
+bool roaring_bitmap::container::contains(uint16_t low) const
+{
+    if (is_bitmap())
+        return (bits[low >> 6] >> (low & 63)) & 1;
+    return std::binary_search(array.begin(), array.end(), low);
+}
+
+/**
+ * @brief Converts a sparse container into a dense one
+ */
+void roaring_bitmap::container::to_bitmap()
+{
+    bits.assign(words_per_bitmap, 0);
+    for (auto low : array)
+        bits[low >> 6] |= uint64_t(1) << (low & 63);
+    array.clear();
+    array.shrink_to_fit();
+}
+
+/**
+ * @brief Converts a dense container with few ids back into a sparse one
+ */
+void roaring_bitmap::container::shrink()
+{
+    if (!is_bitmap() || card > max_array_size)
+        return;
+    array.reserve(card);
+    for (size_t w = 0; w < words_per_bitmap; ++w)
+        for (auto word = bits[w]; word; word &= word - 1)
+            array.push_back(uint16_t(w * 64 + std::countr_zero(word)));
+    bits.clear();
+    bits.shrink_to_fit();
+}
+
+/**
+ * @brief Adds an id
+ * @param id the id
+ */
+void roaring_bitmap::add(uint32_t id)
+{
+    uint16_t key = id >> 16, low = id & 0xffff;
+    auto it = std::lower_bound(containers.begin(), containers.end(), key,
+                               [](const container &c, uint16_t k)
+                               { return c.key < k; });
+    if (it == containers.end() || it->key != key)
+    {
+        it = containers.insert(it, container{});
+        it->key = key;
+    }
+    if (it->is_bitmap())
+    {
+        auto &word = it->bits[low >> 6];
+        auto bit = uint64_t(1) << (low & 63);
+        it->card += !(word & bit);
+        word |= bit;
+        return;
+    }
+    auto pos = std::lower_bound(it->array.begin(), it->array.end(), low);
+    if (pos != it->array.end() && *pos == low)
+        return;
+    it->array.insert(pos, low);
+    if (++it->card > max_array_size)
+        it->to_bitmap();
+}
+
+/**
+ * @brief Tests an id
+ * @param id the id
+ * @return true if present
+ */
+bool roaring_bitmap::contains(uint32_t id) const
+{
+    uint16_t key = id >> 16;
+    auto it = std::lower_bound(containers.begin(), containers.end(), key,
+                               [](const container &c, uint16_t k)
+                               { return c.key < k; });
+    return it != containers.end() && it->key == key && it->contains(id & 0xffff);
+}
+
+/**
+ * @brief Counts ids in [from, to]
+ * @param from lower bound
+ * @param to upper bound
+ * @return number of ids
+ */
+uint64_t roaring_bitmap::cardinality(uint32_t from, uint32_t to) const
+{
+    uint64_t res = 0;
+    for (auto &c : containers)
+    {
+        uint32_t first = uint32_t(c.key) << 16, last = first | 0xffff;
+        if (last < from || first > to)
+            continue;
+        if (first >= from && last <= to)
+        {
+            res += c.card;
+            continue;
+        }
+        roaring_bitmap edge;
+        edge.containers.push_back(c);
+        edge.for_each(from, to, [&res](uint32_t)
+                      { ++res; return true; });
+    }
+    return res;
+}
+
+/**
+ * @brief Combines two containers with the same key
+ * @param a first container
+ * @param b second container
+ * @param is_xor XOR if true, AND otherwise
+ * @return resulting container, possibly empty
+ */
+roaring_bitmap::container roaring_bitmap::combine_containers(const container &a, const container &b, bool is_xor)
+{
+    container res;
+    res.key = a.key;
+    if (a.is_bitmap() && b.is_bitmap())
+    {
+        // word-wise loop, vectorized by the compiler
+        res.bits.resize(words_per_bitmap);
+        const uint64_t *pa = a.bits.data(), *pb = b.bits.data();
+        uint64_t *pr = res.bits.data();
+        if (is_xor)
+            for (size_t w = 0; w < words_per_bitmap; ++w)
+                pr[w] = pa[w] ^ pb[w];
+        else
+            for (size_t w = 0; w < words_per_bitmap; ++w)
+                pr[w] = pa[w] & pb[w];
+        for (size_t w = 0; w < words_per_bitmap; ++w)
+            res.card += std::popcount(pr[w]);
+        res.shrink();
+        return res;
+    }
+    if (!a.is_bitmap() && !b.is_bitmap())
+    {
+        if (is_xor)
+            std::set_symmetric_difference(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                                          std::back_inserter(res.array));
+        else
+            std::set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                                  std::back_inserter(res.array));
+        res.card = res.array.size();
+        if (res.card > max_array_size)
+            res.to_bitmap();
+        return res;
+    }
+    auto &dense = a.is_bitmap() ? a : b;
+    auto &sparse = a.is_bitmap() ? b : a;
+    if (is_xor)
+    {
+        res.bits = dense.bits;
+        res.card = dense.card;
+        for (auto low : sparse.array)
+        {
+            auto bit = uint64_t(1) << (low & 63);
+            auto &word = res.bits[low >> 6];
+            if (word & bit)
+                --res.card;
+            else
+                ++res.card;
+            word ^= bit;
+        }
+        res.shrink();
+        return res;
+    }
+    for (auto low : sparse.array)
+        if (dense.contains(low))
+            res.array.push_back(low);
+    res.card = res.array.size();
+    return res;
+}
+
+/**
+ * @brief Combines containers of two bitmaps whose keys cover [from, to]
+ * @param a first bitmap
+ * @param b second bitmap
+ * @param from lower bound of ids of interest
+ * @param to upper bound of ids of interest
+ * @param is_xor XOR if true, AND otherwise
+ * @return resulting bitmap, may hold ids outside of [from, to] in edge containers
+ */
+roaring_bitmap roaring_bitmap::combine(const roaring_bitmap &a, const roaring_bitmap &b,
+                                       uint32_t from, uint32_t to, bool is_xor)
+{
+    roaring_bitmap res;
+    uint16_t lo = from >> 16, hi = to >> 16;
+    auto ia = a.containers.begin(), ib = b.containers.begin();
+    while (ia != a.containers.end() || ib != b.containers.end())
+    {
+        bool take_a = ib == b.containers.end() || (ia != a.containers.end() && ia->key <= ib->key);
+        bool take_b = ia == a.containers.end() || (ib != b.containers.end() && ib->key <= ia->key);
+        uint16_t key = take_a ? ia->key : ib->key;
+        if (key > hi)
+            break;
+        if (key >= lo)
+        {
+            if (take_a && take_b)
+            {
+                auto c = combine_containers(*ia, *ib, is_xor);
+                if (c.card)
+                    res.containers.push_back(std::move(c));
+            }
+            else if (is_xor)
+                res.containers.push_back(take_a ? *ia : *ib);
+        }
+        if (take_a)
+            ++ia;
+        if (take_b)
+            ++ib;
+    }
+    return res;
+}
+
+/**
+ * @brief Ids present in both bitmaps
+ */
+roaring_bitmap roaring_bitmap::intersection(const roaring_bitmap &a, const roaring_bitmap &b,
+                                            uint32_t from, uint32_t to)
+{
+    return combine(a, b, from, to, false);
+}
+
+/**
+ * @brief Ids present in exactly one of the bitmaps
+ */
+roaring_bitmap roaring_bitmap::symmetric_difference(const roaring_bitmap &a, const roaring_bitmap &b,
+                                                    uint32_t from, uint32_t to)
+{
+    return combine(a, b, from, to, true);
+}
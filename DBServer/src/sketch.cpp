@@ -0,0 +1,144 @@
+/**
+ * @brief sketch.cpp
+ * HyperLogLog and MinHash summaries of table id sets
+ *
+ */
+#include "sketch.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+/**
+ * @brief Accounts a hash in the counter
+ * @param hash hashed id
+ */
+void hyperloglog::add(uint64_t hash)
+{
+    auto index = hash >> (64 - precision);
+    auto rest = hash << precision;
+    uint8_t rank = rest ? std::countl_zero(rest) + 1 : 64 - precision + 1;
+    registers[index] = std::max(registers[index], rank);
+}
+
+/**
+ * @brief Turns the counter into the one of the sets union
+ * @param other counter of another set
+ */
+void hyperloglog::merge(const hyperloglog &other)
+{
+    for (size_t i = 0; i < nof_registers; ++i)
+        registers[i] = std::max(registers[i], other.registers[i]);
+}
+
+/**
+ * @brief Estimates number of distinct hashes added,
+ *        with linear counting for small cardinalities
+ * @return estimate
+ */
+double hyperloglog::estimate() const
+{
+    constexpr double m = nof_registers;
+    constexpr double alpha = 0.7213 / (1.0 + 1.079 / m);
+    double sum = 0;
+    size_t zeros = 0;
+    for (auto r : registers)
+    {
+        sum += std::ldexp(1.0, -r);
+        zeros += (r == 0);
+    }
+    double raw = alpha * m * m / sum;
+    if (raw <= 2.5 * m && zeros)
+        return m * std::log(m / zeros);
+    return raw;
+}
+
+/**
+ * @brief Accounts a hash in the bottom-k sample
+ * @param hash hashed id
+ */
+void minhash::add(uint64_t hash)
+{
+    if (heap.size() < k)
+    {
+        heap.push_back(hash);
+        std::push_heap(heap.begin(), heap.end());
+        return;
+    }
+    if (hash >= heap.front())
+        return;
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = hash;
+    std::push_heap(heap.begin(), heap.end());
+}
+
+/**
+ * @brief Estimates Jaccard similarity |A ∩ B| / |A ∪ B|:
+ *        the share of the k smallest union hashes present in both samples
+ * @param a sample of the first set
+ * @param b sample of the second set
+ * @return similarity in [0, 1]
+ */
+double minhash::jaccard(const minhash &a, const minhash &b)
+{
+    std::vector<uint64_t> sa(a.heap), sb(b.heap);
+    std::sort(sa.begin(), sa.end());
+    std::sort(sb.begin(), sb.end());
+
+    size_t taken = 0, both = 0;
+    auto ia = sa.begin(), ib = sb.begin();
+    while (taken < k && (ia != sa.end() || ib != sb.end()))
+    {
+        if (ib == sb.end() || (ia != sa.end() && *ia < *ib))
+            ++ia;
+        else if (ia == sa.end() || *ib < *ia)
+            ++ib;
+        else
+        {
+            ++both;
+            ++ia;
+            ++ib;
+        }
+        ++taken;
+    }
+    return taken ? double(both) / taken : 0.0;
+}
+
+/**
+ * @brief Mirrors a successful insert
+ * @param id inserted id
+ */
+void table_sketch::add(int64_t id)
+{
+    auto hash = id_hash(id);
+    hll.add(hash);
+    mh.add(hash);
+    ++rows;
+}
+
+/**
+ * @brief Mirrors table truncation
+ */
+void table_sketch::clear()
+{
+    hll.clear();
+    mh.clear();
+    rows = 0;
+}
+
+/**
+ * @brief Estimates |A ∩ B| and |A Δ B| from the tables' sketches
+ * @param a sketch of the first table
+ * @param b sketch of the second table
+ * @return estimates
+ */
+set_estimate estimate_set_operations(const table_sketch &a, const table_sketch &b)
+{
+    double na = a.rows, nb = b.rows;
+
+    hyperloglog u = a.hll;
+    u.merge(b.hll);
+    double uni = std::clamp(u.estimate(), std::max(na, nb), na + nb);
+    double inter = std::clamp(minhash::jaccard(a.mh, b.mh) * uni, 0.0, std::min(na, nb));
+
+    return {inter, uni - inter};
+}
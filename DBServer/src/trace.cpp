@@ -0,0 +1,99 @@
+/**
+ * @brief trace.cpp
+ * Spans of request processing written as Chrome / Perfetto trace JSON
+ *
+ */
+#include "trace.h"
+#include <cstdio>
+#include <unistd.h>
+
+/**
+ * @brief Finds the buffer of the calling thread, registers it on the first call
+ * @return the buffer
+ */
+trace_buffer_t &tracer_t::local_buffer()
+{
+    thread_local std::shared_ptr<trace_buffer_t> buffer;
+    if (!buffer)
+    {
+        buffer = std::make_shared<trace_buffer_t>();
+        buffer->thread_id = static_cast<uint32_t>(::gettid());
+        std::lock_guard lock(buffers_mutex);
+        buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+/**
+ * @brief Appends a span to the buffer of the calling thread
+ * @param name span name
+ * @param arg_name name of the argument, nullptr if none
+ * @param arg argument
+ * @param begin_ns start, steady clock
+ * @param end_ns end, steady clock
+ */
+void tracer_t::record(const char *name, const char *arg_name, uint64_t arg, int64_t begin_ns, int64_t end_ns)
+{
+    auto &buffer = local_buffer();
+    auto count = buffer.count.load(std::memory_order_relaxed);
+    if (count == TRACE_BUFFER_EVENTS)
+    {
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    buffer.events[count] = {name, arg_name, arg, begin_ns, end_ns - begin_ns};
+    buffer.count.store(count + 1, std::memory_order_release);
+}
+
+/**
+ * @brief Stops tracing and writes the spans to the file given to start,
+ * once however many exit paths call it
+ * @return false if the file can not be written
+ */
+bool tracer_t::finish()
+{
+    if (path.empty() || finished.exchange(true))
+        return true;
+    stop();
+    return write(path);
+}
+
+/**
+ * @brief Writes the spans recorded so far in Chrome trace event format,
+ * loadable by chrome://tracing and ui.perfetto.dev
+ * @param path file to write
+ * @return false if the file can not be written
+ */
+bool tracer_t::write(const std::string &path)
+{
+    FILE *out = std::fopen(path.c_str(), "w");
+    if (!out)
+        return false;
+    auto pid = static_cast<int>(::getpid());
+    const char *separator = "";
+    std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+    std::lock_guard lock(buffers_mutex);
+    for (auto &buffer : buffers)
+    {
+        std::fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                          "\"args\":{\"name\":\"thread %u, %llu spans dropped\"}}",
+                     separator, pid, buffer->thread_id, buffer->thread_id,
+                     static_cast<unsigned long long>(buffer->dropped.load(std::memory_order_relaxed)));
+        separator = ",";
+        auto count = buffer->count.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto &event = buffer->events[i];
+            std::fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"join_server\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+                              "\"ts\":%lld.%03lld,\"dur\":%lld.%03lld",
+                         event.name, pid, buffer->thread_id,
+                         static_cast<long long>(event.begin_ns / 1000), static_cast<long long>(event.begin_ns % 1000),
+                         static_cast<long long>(event.duration_ns / 1000), static_cast<long long>(event.duration_ns % 1000));
+            if (event.arg_name)
+                std::fprintf(out, ",\"args\":{\"%s\":%llu}", event.arg_name, static_cast<unsigned long long>(event.arg));
+            std::fputs("}", out);
+        }
+    }
+    std::fputs("\n]}\n", out);
+    return std::fclose(out) == 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * @brief compressor.h Contains definitions for compressor.cpp,
+ *        streaming compression of reply batches
+ *
+ */
+#pragma once
+
+#include <zlib.h>
+#ifdef JOIN_SERVER_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef JOIN_SERVER_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Shorter reply batches are sent as they are
+ */
+constexpr size_t COMPRESS_MIN_BATCH = 512;
+
+enum class codec_t : uint8_t
+{
+    none = 0,
+    zlib = 1,
+    lz4 = 2, // only if built with JOIN_SERVER_WITH_LZ4
+    zstd = 3 // only if built with JOIN_SERVER_WITH_ZSTD
+};
+
+/**
+ * @brief One compression stream per connection: every batch is compressed
+ * and flushed on its own, so it can be decompressed as soon as it arrives,
+ * while the history of earlier batches keeps improving the ratio
+ */
+class reply_compressor
+{
+private:
+    codec_t codec = codec_t::none;
+    z_stream zs{};
+#ifdef JOIN_SERVER_WITH_ZSTD
+    ZSTD_CCtx *zstd = nullptr;
+#endif
+#ifdef JOIN_SERVER_WITH_LZ4
+    LZ4F_cctx *lz4 = nullptr;
+    bool lz4_begun = false;
+#endif
+
+    void close();
+    void deflate_batch(std::string_view batch, std::string &out);
+    void zstd_batch(std::string_view batch, std::string &out);
+    void lz4_batch(std::string_view batch, std::string &out);
+
+public:
+    reply_compressor() = default;
+    reply_compressor(const reply_compressor &) = delete;
+    reply_compressor &operator=(const reply_compressor &) = delete;
+    ~reply_compressor() { close(); }
+
+    static std::optional<codec_t> codec_of(std::string_view name);
+    void reset(codec_t _codec);
+    codec_t get_codec() const { return codec; }
+    std::string compress(std::string_view batch, uint32_t request_id);
+};
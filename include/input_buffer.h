@@ -0,0 +1,51 @@
+/**
+ * @brief input_buffer.h Contains definitions for input_buffer.cpp,
+ *        the framing buffer of received client bytes
+ *
+ */
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace asio = boost::asio;
+
+/**
+ * @brief Growable receive buffer: the socket reads straight into its free tail,
+ *        commands are parsed in place and consumed from its head.
+ *        Unconsumed bytes are moved to the front only when the free tail
+ *        gets short, so each byte is copied at most once in the common case
+ */
+class input_buffer
+{
+private:
+    std::vector<char> buf;
+    size_t head = 0;    // first unconsumed byte
+    size_t tail = 0;    // end of received bytes
+    size_t scanned = 0; // bytes before this offset hold no delimiter
+    size_t min_read;    // least free space offered to a read
+
+public:
+    explicit input_buffer(size_t capacity);
+
+    asio::mutable_buffer prepare();
+    void commit(size_t n) { tail += n; }
+    void reserve(size_t n);
+    void consume(size_t n);
+    std::string_view data() const { return std::string_view(buf.data() + head, tail - head); }
+    size_t find_delimiter(char first, char second);
+};
+
+/**
+ * @brief Finds the first of two bytes, 16 bytes per step where SSE2 is available
+ * @param p begin of bytes
+ * @param n number of bytes
+ * @param first byte to find
+ * @param second another byte to find
+ * @return offset of the byte found, n if there is none
+ */
+size_t find_first_of2(const char *p, size_t n, char first, char second);
@@ -5,49 +5,224 @@
 #pragma once
 
 #include "db_server.h"
+#include "input_buffer.h"
+#include "shm_ring.h"
+#include "slot_map.h"
+#include "timer_wheel.h"
+#include "compressor.h"
+#include "placement.h"
+#include "logger.h"
+#include "trace.h"
 
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/co_spawn.hpp>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/asio/ip/address_v4.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
 #include <boost/asio/detached.hpp>
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/system/detail/error_code.hpp>
 
 #include <iostream>
 #include <tuple>
 #include <string>
-#include <list>
+#include <deque>
+#include <optional>
+#include <chrono>
+#include <charconv>
+#include <vector>
 #include <memory>
 #include <coroutine>
 #include <utility>
+#include <algorithm>
+#include <sys/resource.h>
 
 namespace asio = boost::asio;
 using port_t = asio::ip::port_type;
-using socket_t = asio::ip::tcp::socket;
+using socket_t = asio::generic::stream_protocol::socket; // TCP or Unix domain
 
 constexpr auto default_ip = "127.0.0.1";
 constexpr port_t default_port = 4507;
+constexpr auto default_unix_path = "/tmp/join_server.sock";
 constexpr unsigned char DISCONNECT = 0x4;
 
+/**
+ * @brief Name of the Asio backend running socket operations, chosen at build time
+ */
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+constexpr auto io_backend = "io_uring";
+#else
+constexpr auto io_backend = "epoll";
+#endif
+
+/**
+ * @brief Upper bound of bytes of long replies sent by one write,
+ * so that urgent replies queued meanwhile wait for one write at most
+ */
+constexpr size_t MAX_WRITE_SIZE = 256 * 1024;
+
+/**
+ * @brief On shutdown connections get this long to receive their replies
+ */
+constexpr auto DRAIN_DEADLINE = std::chrono::seconds(5);
+
+/**
+ * @brief A longer command or frame is taken for garbage, the client is disconnected
+ */
+constexpr size_t MAX_COMMAND_SIZE = 16 * 1024 * 1024;
+
+/**
+ * @brief Tick of the connections timer wheel, timeouts are counted in ticks
+ */
+constexpr auto TIMER_TICK = std::chrono::seconds(1);
+
+/**
+ * @brief Descriptors a connection holds: its socket, the database file,
+ * its journal and the shared memory ring; and descriptors of the server itself
+ */
+constexpr size_t FDS_PER_CONNECTION = 4;
+constexpr size_t FDS_RESERVED = 64;
+
+/**
+ * @brief On running out of descriptors accepting is suspended this long
+ */
+constexpr auto ACCEPT_BACKOFF = std::chrono::milliseconds(100);
+
+/**
+ * @brief Connections fitting the descriptor limit of the process, 1024 at most
+ * @return default of --max-connections
+ */
+inline size_t default_max_connections()
+{
+    rlimit limit;
+    if (::getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY)
+        return 1024;
+    auto available = limit.rlim_cur > FDS_RESERVED + FDS_PER_CONNECTION ? limit.rlim_cur - FDS_RESERVED : FDS_PER_CONNECTION;
+    return std::min<size_t>(1024, available / FDS_PER_CONNECTION);
+}
+
+/**
+ * @brief Limits keeping the server predictable under overload,
+ * set by --max-connections=, --max-inflight=, --max-queued-bytes=,
+ * --idle-timeout=, --read-timeout= and --write-timeout= options.
+ * Connections over the limit are told so and closed at once, commands over
+ * the limits are answered by an error without being executed,
+ * connections over the timeouts are closed
+ */
+struct server_limits
+{
+    size_t max_connections = default_max_connections();
+    size_t max_inflight = 64 * 1024;           // replies not sent yet, server-wide
+    size_t max_queued_bytes = 64 * 1024 * 1024; // reply bytes not sent yet, per connection
+    size_t idle_timeout = 300; // seconds without commands
+    size_t read_timeout = 30;  // seconds receiving an unfinished command
+    size_t write_timeout = 30; // seconds sending replies without progress
+};
+
+/**
+ * @brief Placement and waiting policy of the io thread, set by
+ * --cpu=, --numa-node= and --busy-poll= options. In busy-poll mode the thread
+ * spins polling the coro loop instead of sleeping in the kernel, trading a core
+ * for the wakeup latency; sockets ask the kernel to busy-poll the device
+ * queue for the given microseconds where SO_BUSY_POLL is supported.
+ * Connections allocate their memory on the node the io thread runs on
+ */
+struct io_options
+{
+    size_t cpu = NO_CPU;     // core the io thread is pinned to
+    size_t numa_node = NO_NODE; // node the io thread and its memory are placed on
+    size_t busy_poll_us = 0; // 0 - block waiting for events
+};
+
+void place_io_thread(const io_options &io);
+
+/**
+ * @brief What the server tells about itself, set by --log-level=,
+ * --stats-period=, --trace= and --slow-command-ms= options: the lowest level
+ * logged (0 debug, 1 info, 2 warning, 3 error), the period latency histograms
+ * are logged with, the file spans of request processing are written to on
+ * shutdown and the time a command is logged as slow after
+ */
+struct monitor_options
+{
+    size_t log_level = static_cast<size_t>(log_level_t::info);
+    size_t stats_period = 60; // seconds, 0 - never
+    std::string trace_path;   // Chrome trace JSON, empty - no tracing
+    size_t slow_command_ms = 1000; // commands logged with their query plans, 0 - never
+};
+
+asio::awaitable<void> dump_stats(std::chrono::seconds period);
+
+/**
+ * @brief Threads running the coro loop, each owns a shard of the connections registry
+ */
+constexpr size_t NOF_IO_THREADS = 1;
+
+/**
+ * @brief Index of the io thread running the current handler
+ */
+inline thread_local size_t io_thread = 0;
+
 inline asio::io_context context;
 
 /**
  * @brief Connection object, specifically contains a pointer to client's db 
  *        and a connection-initialized socket
  */
-struct connection_t
+struct connection_t : std::enable_shared_from_this<connection_t>
 {
     std::shared_ptr<db_t> pdbt;
     socket_t socket;
+    slot_handle_t id;                 // place in the connections registry
+    input_buffer input{0};            // received bytes, sized when the connection is accepted
+    std::deque<reply_batch_t> urgent;   // whole small replies, may overtake outbound ones
+    std::deque<reply_batch_t> outbound; // encoded replies waiting to be sent
+    size_t queued_bytes = 0;          // bytes of queued and being sent batches
+    size_t unsent_replies = 0;        // replies whose last batch is not sent yet
+    bool writing = false;             // write_replies coroutine is running
+    bool closing = false;             // disconnect once the replies are sent
+    bool local = false;               // connected by the Unix domain socket
+    bool corked = false;              // TCP_CORK is set
+    uint64_t last_read = 0;           // tick of the last command received
+    uint64_t last_admitted = 0;       // tick of the last command admitted for execution
+    uint64_t partial_since = 0;       // tick an unfinished command is received since
+    uint64_t last_write = 0;          // tick of the last write progress
+    uint64_t scheduled = 0;           // tick of the earliest timer armed, 0 if none
+    bool graced = false;              // got a tick past its deadline for pending I/O to run
+    shm_ring shm;                     // shared memory transport of long replies
+    int passing_fd = -1;              // descriptor to pass along with the next write
+    reply_compressor compressor;      // compression of long reply batches
+    std::string peer;                 // client address, "unix" for the Unix domain socket
+    uint64_t bytes_in = 0;            // received from the client
+    uint64_t bytes_out = 0;           // sent to the client, as on the wire
     asio::awaitable<void> read_requests();
-    asio::awaitable<void> send_reply(std::string reply);
+    asio::awaitable<void> write_replies();
+    void queue_reply(reply_batch_t batch);
+    void forget_replies(const std::vector<reply_batch_t> &batches);
+    void close_after_replies();
+    void set_cork(bool on);
+    bool admit(uint32_t request_id, bool echo_id);
+    bool process_input();
+    bool reject_input(uint32_t request_id);
+    void execute(const std::string &cmd, uint32_t request_id);
+    bool execute_session_cmd(const std::string &cmd, uint32_t request_id, bool echo_id);
+    void reply_stats(std::string_view arg);
+    void reply_sessions();
+    void setup_shm(std::string_view arg);
+    void setup_compression(std::string_view arg);
+    asio::awaitable<void> pass_fd(char byte);
+    uint64_t deadline() const;
 
     connection_t(std::string _db_directory,
-                 foreign_callback_t foreign_callback
+                 foreign_callback_t foreign_callback,
+                 socket_t &&_socket
                  );
     
     
@@ -63,22 +238,51 @@ class join_server_t
 private:
     std::string ip_addr;
     port_t port;
-    std::list<handle_t> connections; // Collection of connections
-    friend void SIGINT_handler([[maybe_unused]] int _signal); // Ctrl-C signal handler
+    std::string unix_path;           // Unix domain socket for local clients
+    sharded_slot_map<handle_t> connections{NOF_IO_THREADS}; // Collection of connections
+    std::optional<asio::ip::tcp::acceptor> acceptor;
+    std::optional<asio::local::stream_protocol::acceptor> local_acceptor;
+    bool draining = false; // shutting down, no more requests are taken
+    server_limits limits;
+    io_options io;
+    size_t inflight = 0;   // replies of all connections not sent yet
+    timer_wheel<slot_handle_t> timers; // deadlines of connections
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now(); // tick 0
     friend asio::awaitable<void> run_server(asio::io_context &context);
+    template <typename Acceptor>
+    friend asio::awaitable<void> accept_clients(Acceptor &acceptor, bool local);
 
 public:
     void print_running()
     {
-        std::cout << "join_server running at " + ip_addr << ":" << port << "\n";
+        std::cout << "join_server running at " + ip_addr << ":" << port
+                  << " and " << unix_path << " (" << io_backend << ")\n";
     }
 
     std::string get_ip_addr() { return ip_addr; }
     port_t get_port() { return port; }
+    std::string get_unix_path() { return unix_path; }
+
+    bool is_draining() { return draining; }
+    const server_limits &get_limits() { return limits; }
+    const io_options &get_io() { return io; }
+    bool is_busy() { return inflight >= limits.max_inflight; }
+    void count_inflight(size_t queued, size_t sent) { inflight = inflight + queued - sent; }
+    uint64_t tick() { return timers.get_now(); }
+    void arm(connection_t *conn);
+    asio::awaitable<void> expire_connections();
 
     void disconnect(connection_t *conn);
+    template <typename F>
+    void for_each_connection(F f)
+    {
+        for (size_t i = 0; i < NOF_IO_THREADS; ++i)
+            connections.shard(i).for_each(f);
+    }
+    asio::awaitable<void> drain();
 
-    join_server_t(const std::string _ip_addr, port_t _port);
+    join_server_t(const std::string _ip_addr, port_t _port, const std::string _unix_path,
+                  const server_limits &_limits, const io_options &_io);
     ~join_server_t();
 };
 
@@ -87,49 +291,73 @@ public:
  */
 inline std::unique_ptr<join_server_t> p_joinserver;
 
-/**
- * @brief Handles CTRL-C signal to softly shutdown the server
- * @param _signal
- */
-void SIGINT_handler([[maybe_unused]] int _signal)
-{
-    context.stop(); // stop the coro loop
-}
-
-void establish_SIGINT_handler()
-{
-    // Establish CTRL-C handler
-    struct sigaction handler;
-    handler.sa_handler = SIGINT_handler;
-    sigemptyset(&handler.sa_mask);
-    handler.sa_flags = 0;
-    sigaction(SIGINT, &handler, NULL);
-}
-
 /**
  * @brief Proceed command string args
- * @param argc 0 or 1
- * @param argv optional port number
+ * @param argc number of args
+ * @param argv optional port number and Unix domain socket path,
+ * optional --<limit>=<value> options anywhere
  * @param server_port output parameter to store the port
+ * @param unix_path output parameter to store the Unix domain socket path
+ * @param limits output parameter to store the limits
+ * @param io output parameter to store the io thread options
+ * @param monitor output parameter to store the logging and statistics options
  * @return true if args are viable
  */
-inline bool get_params(int argc, char **argv, port_t &server_port)
+inline bool get_params(int argc, char **argv, port_t &server_port, std::string &unix_path,
+                       server_limits &limits, io_options &io, monitor_options &monitor)
 {
     bool res = true;
     server_port = default_port;
-    switch (argc)
+    unix_path = default_unix_path;
+    std::vector<std::string_view> positional;
+    for (int i = 1; i < argc && res; ++i)
     {
-    case 1:
-        server_port = default_port;
-        break;
-    case 2:
-        server_port = std::atoi(argv[1]);
-        break;
-    default:
-        std::cout << "The use is: join_server <port number>\n"
-                     "or\tjoin_server\n";
-        res = false;
-        break;
+        std::string_view arg(argv[i]);
+        if (!arg.starts_with("--"))
+        {
+            positional.push_back(arg);
+            continue;
+        }
+        auto eq = arg.find('=');
+        auto key = arg.substr(0, eq);
+        if (key == "--trace")
+        {
+            res = eq != std::string_view::npos && eq + 1 < arg.size();
+            monitor.trace_path = arg.substr(std::min(eq + 1, arg.size()));
+            continue;
+        }
+        size_t *option = key == "--max-connections"    ? &limits.max_connections
+                         : key == "--max-inflight"     ? &limits.max_inflight
+                         : key == "--max-queued-bytes" ? &limits.max_queued_bytes
+                         : key == "--idle-timeout"     ? &limits.idle_timeout
+                         : key == "--read-timeout"     ? &limits.read_timeout
+                         : key == "--write-timeout"    ? &limits.write_timeout
+                         : key == "--cpu"              ? &io.cpu
+                         : key == "--numa-node"        ? &io.numa_node
+                         : key == "--busy-poll"        ? &io.busy_poll_us
+                         : key == "--log-level"        ? &monitor.log_level
+                         : key == "--stats-period"     ? &monitor.stats_period
+                         : key == "--slow-command-ms"  ? &monitor.slow_command_ms
+                                                       : nullptr;
+        auto value = arg.substr(std::min(eq + 1, arg.size()));
+        size_t number = 0;
+        auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), number);
+        res = option && eq != std::string_view::npos && ec == std::errc() && ptr == value.data() + value.size();
+        if (res)
+            *option = number;
     }
+    if (res && (positional.size() > 2 || monitor.log_level > static_cast<size_t>(log_level_t::error)))
+        res = false;
+    if (res && positional.size() > 1)
+        unix_path = positional[1];
+    if (res && positional.size() > 0)
+        server_port = std::atoi(positional[0].data());
+    if (!res)
+        std::cout << "The use is: join_server [<port number> [<unix socket path>]] [options]\n"
+                     "options:\t--max-connections=<n> --max-inflight=<n> --max-queued-bytes=<n>\n"
+                     "\t\t--idle-timeout=<s> --read-timeout=<s> --write-timeout=<s>\n"
+                     "\t\t--cpu=<core> --numa-node=<node> --busy-poll=<us>\n"
+                     "\t\t--log-level=<0 debug|1 info|2 warning|3 error> --stats-period=<s>\n"
+                     "\t\t--trace=<Chrome trace JSON file> --slow-command-ms=<ms>\n";
     return res;
 }
@@ -0,0 +1,24 @@
+/**
+ * @brief placement.h Contains definitions for placement.cpp,
+ *        placement of server threads on cores and NUMA nodes
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <limits>
+
+/**
+ * @brief Core number meaning "not pinned"
+ */
+constexpr size_t NO_CPU = std::numeric_limits<size_t>::max();
+
+/**
+ * @brief NUMA node number meaning "no node", also when built without libnuma
+ */
+constexpr size_t NO_NODE = std::numeric_limits<size_t>::max();
+
+bool pin_current_thread(size_t cpu);
+bool pin_current_thread_to_node(size_t node);
+size_t node_of_cpu(size_t cpu);
+bool prefer_node(size_t node);
@@ -0,0 +1,52 @@
+/**
+ * @brief shm_ring.h Contains definitions for shm_ring.cpp,
+ *        the shared memory transport of replies to local clients
+ *
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief Limits of the shared memory ring size, requested by "SHM <bytes>"
+ */
+constexpr size_t SHM_MIN_SIZE = 64 * 1024;
+constexpr size_t SHM_MAX_SIZE = 1024 * 1024 * 1024;
+
+/**
+ * @brief Reply batches shorter than this are sent over the socket anyway
+ */
+constexpr size_t SHM_MIN_BATCH = 4 * 1024;
+
+/**
+ * @brief Ring of reply bytes in a memfd shared with a local client.
+ * Batches are placed contiguously, a batch not fitting before the end of
+ * the ring starts from its beginning. Every placed batch is announced by
+ * a SHM_DATA frame sent over the socket in place of the batch, so replies
+ * keep their order. The client gives the space back by SHM_RELEASE frames
+ */
+class shm_ring
+{
+private:
+    int fd = -1;
+    char *base = nullptr;
+    size_t capacity = 0;
+    uint64_t written = 0;  // bytes placed since opening, wrap padding included
+    uint64_t released = 0; // bytes given back by the client
+
+public:
+    shm_ring() = default;
+    shm_ring(const shm_ring &) = delete;
+    shm_ring &operator=(const shm_ring &) = delete;
+    ~shm_ring();
+
+    void open(size_t size);
+    bool is_open() const { return base != nullptr; }
+    int get_fd() const { return fd; }
+    std::optional<std::string> place(std::string_view batch, uint32_t request_id);
+    void release(uint64_t mark);
+};
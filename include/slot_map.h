@@ -0,0 +1,138 @@
+/**
+ * @brief slot_map.h Slot map and its per-thread sharded version,
+ *        the registry of connections
+ *
+ */
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Handle of a slot map element: the slot index and the generation
+ * of the slot when the element was inserted. A handle of an erased element
+ * never matches again, even if its slot is reused
+ */
+struct slot_handle_t
+{
+    uint32_t shard = 0;
+    uint32_t index = std::numeric_limits<uint32_t>::max();
+    uint32_t generation = 0;
+};
+
+/**
+ * @brief Vector of slots with a free list: O(1) insert, erase and lookup
+ * by handle, no allocation once the vector has grown to the peak size
+ */
+template <typename T>
+class slot_map
+{
+private:
+    static constexpr uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
+    struct slot_t
+    {
+        std::optional<T> value;
+        uint32_t generation = 0;
+        uint32_t next_free = NO_SLOT;
+    };
+    std::vector<slot_t> slots;
+    uint32_t free_head = NO_SLOT;
+    size_t count = 0;
+
+public:
+    slot_handle_t insert(T value)
+    {
+        uint32_t index = free_head;
+        if (index == NO_SLOT)
+        {
+            index = static_cast<uint32_t>(slots.size());
+            slots.emplace_back();
+        }
+        else
+            free_head = slots[index].next_free;
+        slots[index].value.emplace(std::move(value));
+        ++count;
+        return {0, index, slots[index].generation};
+    }
+
+    /**
+     * @brief Erases an element, stale handles are ignored
+     * @return true if the element was there
+     */
+    bool erase(slot_handle_t handle)
+    {
+        if (!get(handle))
+            return false;
+        auto &slot = slots[handle.index];
+        slot.value.reset();
+        ++slot.generation;
+        slot.next_free = free_head;
+        free_head = handle.index;
+        --count;
+        return true;
+    }
+
+    T *get(slot_handle_t handle)
+    {
+        if (handle.index >= slots.size())
+            return nullptr;
+        auto &slot = slots[handle.index];
+        return (slot.value && slot.generation == handle.generation) ? &*slot.value : nullptr;
+    }
+
+    size_t size() const { return count; }
+
+    template <typename F>
+    void for_each(F f)
+    {
+        for (auto &slot : slots)
+            if (slot.value)
+                f(*slot.value);
+    }
+};
+
+/**
+ * @brief Slot maps owned by threads: a thread inserts into its own shard
+ * and only the owner erases, so shards need no locking.
+ * The total size is shared and kept atomic
+ */
+template <typename T>
+class sharded_slot_map
+{
+private:
+    std::vector<slot_map<T>> shards;
+    std::atomic<size_t> count = 0;
+
+public:
+    explicit sharded_slot_map(size_t nof_shards = 1) : shards(nof_shards) {}
+
+    slot_handle_t insert(size_t shard, T value)
+    {
+        auto handle = shards[shard].insert(std::move(value));
+        handle.shard = static_cast<uint32_t>(shard);
+        ++count;
+        return handle;
+    }
+
+    bool erase(slot_handle_t handle)
+    {
+        if (handle.shard >= shards.size() || !shards[handle.shard].erase(handle))
+            return false;
+        --count;
+        return true;
+    }
+
+    T *get(slot_handle_t handle)
+    {
+        return handle.shard < shards.size() ? shards[handle.shard].get(handle) : nullptr;
+    }
+
+    size_t size() const { return count; }
+
+    slot_map<T> &shard(size_t n) { return shards[n]; }
+};
@@ -0,0 +1,95 @@
+/**
+ * @brief timer_wheel.h Hierarchical timer wheel driven by a single ticking timer
+ *
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Timer wheel of LEVELS levels of SLOTS slots each. Level 0 holds
+ * timers expiring within SLOTS ticks, one slot per tick; a slot of level n
+ * spans SLOTS^n ticks and is spread over the lower levels when reached.
+ * Insertion and expiration are O(1) per timer, timers are never cancelled:
+ * the owner checks on expiration whether the timer still matters
+ */
+template <typename T>
+class timer_wheel
+{
+private:
+    static constexpr size_t LEVEL_BITS = 6;
+    static constexpr size_t SLOTS = size_t(1) << LEVEL_BITS;
+    static constexpr size_t LEVELS = 4;
+    static constexpr uint64_t MAX_DELAY = (uint64_t(1) << (LEVEL_BITS * LEVELS)) - 1;
+
+    struct timer_t
+    {
+        uint64_t expiry;
+        T value;
+    };
+    std::array<std::array<std::vector<timer_t>, SLOTS>, LEVELS> levels;
+    uint64_t now = 0; // the last tick expired
+    size_t count = 0;
+
+    void place(timer_t timer)
+    {
+        uint64_t delay = timer.expiry - now;
+        size_t level = 0;
+        while (level + 1 < LEVELS && delay >= (uint64_t(1) << (LEVEL_BITS * (level + 1))))
+            ++level;
+        levels[level][(timer.expiry >> (LEVEL_BITS * level)) & (SLOTS - 1)].push_back(std::move(timer));
+    }
+
+public:
+    /**
+     * @brief Adds a timer
+     * @param expiry tick to expire at, past ticks expire at the next one
+     * @param value passed to the expiration handler
+     */
+    void insert(uint64_t expiry, T value)
+    {
+        expiry = std::max(expiry, now + 1);
+        expiry = std::min(expiry, now + MAX_DELAY);
+        place({expiry, std::move(value)});
+        ++count;
+    }
+
+    /**
+     * @brief Expires timers up to a tick
+     * @param tick current tick
+     * @param expire handler called with the value and the tick of every expired timer
+     */
+    template <typename F>
+    void advance(uint64_t tick, F expire)
+    {
+        std::vector<timer_t> due;
+        while (now < tick)
+        {
+            ++now;
+            // bring the timers of upper levels reached by this tick down
+            for (size_t level = 1; level < LEVELS; ++level)
+            {
+                if (now & ((uint64_t(1) << (LEVEL_BITS * level)) - 1))
+                    break;
+                auto &slot = levels[level][(now >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+                auto cascading = std::move(slot);
+                slot.clear();
+                for (auto &timer : cascading)
+                    place(std::move(timer));
+            }
+            due.swap(levels[0][now & (SLOTS - 1)]);
+            count -= due.size();
+            for (auto &timer : due)
+                expire(timer.value, now);
+            due.clear();
+        }
+    }
+
+    uint64_t get_now() const { return now; }
+    size_t size() const { return count; }
+};
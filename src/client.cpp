@@ -8,16 +8,24 @@
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/address_v4.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
+#include <boost/asio/read.hpp>
 #include <boost/system/detail/error_code.hpp>
 #include <iostream>
+#include <string_view>
+#include <stdexcept>
+#include <zlib.h>
+#include "wire_protocol.h"
 
 namespace asio = boost::asio;
 
-using socket_t = asio::ip::tcp::socket;
+using socket_t = asio::generic::stream_protocol::socket;
 
 // Client parameters
 constexpr int port = 4507;
 constexpr auto host = "127.0.0.1";
+constexpr auto unix_path = "/tmp/join_server.sock";
 
 // Disconnect from join_server symbol
 constexpr unsigned char DISCONNECT = 0x4;
@@ -25,17 +33,151 @@ constexpr unsigned char DISCONNECT = 0x4;
 // Is received at the end of every whole reply
 constexpr unsigned char END_OF_REPLY = '^';
 
+/**
+ * @brief Receives a text reply and prints it
+ * @param socket connected socket
+ */
+void receive_text_reply(socket_t &socket)
+{
+    boost::system::error_code ec;
+    std::string received_line(1024, '\0');
+    bool eor;
+    do
+    {
+        auto recv_n = socket.receive(asio::buffer(received_line), {}, ec);
+        assert(!ec);
+        assert(recv_n);
+
+        eor = (received_line[recv_n - 1] == END_OF_REPLY);
+        std::cout << std::string_view(received_line.data(), eor ? recv_n - 1 : recv_n);
+    } while (!eor);
+}
+
+/**
+ * @brief Reads frames from the socket, frames of COMPRESSED ones are inflated
+ * by a single zlib stream lasting for the session
+ */
+class frame_reader
+{
+private:
+    socket_t &socket;
+    z_stream zs{};
+    std::string inflated; // frames inflated and not read yet
+    size_t pos = 0;
+
+    void inflate_frames(const std::string &payload)
+    {
+        if (static_cast<uint8_t>(payload[0]) != static_cast<uint8_t>(codec_zlib))
+            throw std::runtime_error("Unexpected codec");
+        inflated.erase(0, pos);
+        pos = 0;
+        size_t used = inflated.size();
+        inflated.resize(used + get_le<uint32_t>(payload.data() + 1));
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(payload.data() + 5));
+        zs.avail_in = static_cast<uInt>(payload.size() - 5);
+        zs.next_out = reinterpret_cast<Bytef *>(inflated.data() + used);
+        zs.avail_out = static_cast<uInt>(inflated.size() - used);
+        auto rc = inflate(&zs, Z_SYNC_FLUSH);
+        if ((rc != Z_OK && rc != Z_BUF_ERROR) || zs.avail_out)
+            throw std::runtime_error("Bad compressed frame");
+    }
+
+public:
+    static constexpr uint8_t codec_zlib = 1;
+
+    explicit frame_reader(socket_t &_socket) : socket(_socket) { inflateInit(&zs); }
+    ~frame_reader() { inflateEnd(&zs); }
+
+    frame_header_t next(std::string &payload)
+    {
+        std::string header(FRAME_HEADER_SIZE, '\0');
+        while (pos == inflated.size())
+        {
+            asio::read(socket, asio::buffer(header));
+            auto h = get_frame_header(header.data());
+            payload.resize(h.length);
+            asio::read(socket, asio::buffer(payload));
+            if (h.opcode != opcode_t::compressed)
+                return h;
+            inflate_frames(payload);
+        }
+        auto h = get_frame_header(inflated.data() + pos);
+        payload.assign(inflated, pos + FRAME_HEADER_SIZE, h.length);
+        pos += FRAME_HEADER_SIZE + h.length;
+        return h;
+    }
+};
+
+/**
+ * @brief Receives binary frames up to the end of reply and prints them as text
+ * @param reader frames of connected socket
+ */
+void receive_binary_reply(frame_reader &reader)
+{
+    std::string payload;
+    while (true)
+    {
+        auto h = reader.next(payload);
+
+        if (h.opcode == opcode_t::ok || h.opcode == opcode_t::error)
+        {
+            if (h.opcode == opcode_t::ok)
+                std::cout << "OK" << (payload.empty() ? "" : ", ") << payload << "\n";
+            else
+                std::cout << "Eror: " << payload << "\n";
+            return;
+        }
+        // ROWS frame: decode without scanning for delimiters
+        for (const char *p = payload.data(), *end = p + payload.size(); p < end;)
+        {
+            auto nof_cols = get_le<uint16_t>(p);
+            p += sizeof(uint16_t);
+            for (uint16_t i = 0; i < nof_cols; ++i)
+            {
+                auto type = static_cast<column_type_t>(*p++);
+                if (type == column_type_t::integer)
+                {
+                    std::cout << get_le<int64_t>(p);
+                    p += sizeof(int64_t);
+                }
+                else if (type == column_type_t::text)
+                {
+                    auto len = get_le<uint32_t>(p);
+                    p += sizeof(uint32_t);
+                    std::cout << std::string_view(p, len);
+                    p += len;
+                }
+                std::cout << (i == nof_cols - 1 ? "\n" : ",");
+            }
+        }
+    }
+}
+
 /**
  * @brief Send commands to join_server and receive replys, disconnects from server at the end
+ * @param argc 1 to 4
+ * @param argv "binary" switches the session to binary protocol,
+ * "unix" connects by the Unix domain socket,
+ * "compress" asks for zlib compressed replies in binary protocol
  * @return
  */
-int main()
+int main(int argc, char **argv)
 {
+    bool binary = false, local = false, compress = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        binary |= (std::string_view(argv[i]) == "binary");
+        local |= (std::string_view(argv[i]) == "unix");
+        compress |= (std::string_view(argv[i]) == "compress");
+    }
     asio::io_context context;
 
     socket_t socket{context};
-    socket.connect(
-        asio::ip::tcp::endpoint{asio::ip::make_address_v4("127.0.0.1"), 4507});
+    if (local)
+        socket.connect(asio::local::stream_protocol::endpoint{unix_path});
+    else
+        socket.connect(
+            asio::ip::tcp::endpoint{asio::ip::make_address_v4(host), port});
 
     std::vector<std::string> lines{
         "INSERT A 0 lean\n",
@@ -47,31 +189,41 @@ int main()
         "INSERT B 8 selection\n",
         "INTERSECTION\n",
         "SYMMETRIC_DIFFERENCE\n",
+        "MERGE\n",
         "TRUNCATE A\n"};
 
     boost::system::error_code ec;
 
+    if (binary)
+    {
+        // negotiated in text protocol
+        lines.insert(lines.begin(), "PROTOCOL BINARY\n");
+        if (compress)
+            lines.insert(lines.begin() + 1, "COMPRESS ZLIB\n");
+    }
+    frame_reader reader(socket);
+
+    uint32_t request_id = 0;
+    bool binary_session = false;
     for (auto line : lines)
     {
         std::cout << line;
 
-        auto send_n = socket.send(asio::buffer(line), {}, ec);
+        auto request = binary_session
+                           ? make_frame(opcode_t::command, ++request_id,
+                                        std::string_view(line).substr(0, line.size() - 1))
+                           : line;
+        auto send_n = socket.send(asio::buffer(request), {}, ec);
         assert(!ec);
-        assert(send_n == line.size());
+        assert(send_n == request.size());
 
-        std::string received_line(1024, '\0');
-        bool eor;
-        do
-        {
-            auto recv_n = socket.receive(asio::buffer(received_line), {}, ec);
-            assert(!ec);
-            assert(recv_n);
-
-            eor = (received_line[recv_n - 1] == END_OF_REPLY);
-            if (eor)
-                received_line.erase(recv_n - 1);
-            std::cout << received_line;
-        } while (!eor);
+        if (binary_session)
+            receive_binary_reply(reader);
+        else
+            receive_text_reply(socket);
+        binary_session = binary;
     }
-    socket.send(asio::buffer(std::string(1, DISCONNECT)), {}, ec);
+    auto disconnect = binary ? make_frame(opcode_t::disconnect, ++request_id)
+                             : std::string(1, DISCONNECT);
+    socket.send(asio::buffer(disconnect), {}, ec);
 }
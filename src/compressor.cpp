@@ -0,0 +1,181 @@
+/**
+ * @brief compressor.cpp
+ * Streaming compression of reply batches
+ *
+ */
+#include "compressor.h"
+#include "wire_protocol.h"
+#include <stdexcept>
+
+/**
+ * @brief Finds a codec built in by its name
+ * @param name ZLIB, LZ4, ZSTD or NONE
+ * @return the codec, nothing if unknown or not built in
+ */
+std::optional<codec_t> reply_compressor::codec_of(std::string_view name)
+{
+    if (name == "NONE")
+        return codec_t::none;
+    if (name == "ZLIB")
+        return codec_t::zlib;
+#ifdef JOIN_SERVER_WITH_LZ4
+    if (name == "LZ4")
+        return codec_t::lz4;
+#endif
+#ifdef JOIN_SERVER_WITH_ZSTD
+    if (name == "ZSTD")
+        return codec_t::zstd;
+#endif
+    return std::nullopt;
+}
+
+/**
+ * @brief Releases the stream of the current codec
+ */
+void reply_compressor::close()
+{
+    if (codec == codec_t::zlib)
+        deflateEnd(&zs);
+#ifdef JOIN_SERVER_WITH_ZSTD
+    ZSTD_freeCCtx(zstd);
+    zstd = nullptr;
+#endif
+#ifdef JOIN_SERVER_WITH_LZ4
+    LZ4F_freeCompressionContext(lz4);
+    lz4 = nullptr;
+    lz4_begun = false;
+#endif
+    codec = codec_t::none;
+}
+
+/**
+ * @brief Starts a new stream
+ * @param _codec codec of the stream
+ */
+void reply_compressor::reset(codec_t _codec)
+{
+    close();
+    switch (_codec)
+    {
+    case codec_t::zlib:
+        zs = z_stream{};
+        // the fastest level: batches are compressed on the io thread
+        if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK)
+            throw std::runtime_error("deflateInit failed");
+        break;
+#ifdef JOIN_SERVER_WITH_ZSTD
+    case codec_t::zstd:
+        zstd = ZSTD_createCCtx();
+        if (!zstd)
+            throw std::runtime_error("ZSTD_createCCtx failed");
+        ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, 1);
+        break;
+#endif
+#ifdef JOIN_SERVER_WITH_LZ4
+    case codec_t::lz4:
+        if (LZ4F_isError(LZ4F_createCompressionContext(&lz4, LZ4F_VERSION)))
+            throw std::runtime_error("LZ4F_createCompressionContext failed");
+        break;
+#endif
+    default:
+        break;
+    }
+    codec = _codec;
+}
+
+/**
+ * @brief Compresses a batch into a COMPRESSED frame
+ * @param batch encoded frames of the batch
+ * @param request_id request id of the reply
+ * @return the frame
+ */
+std::string reply_compressor::compress(std::string_view batch, uint32_t request_id)
+{
+    std::string payload;
+    payload.push_back(static_cast<char>(codec));
+    put_le(payload, static_cast<uint32_t>(batch.size()));
+    if (codec == codec_t::zlib)
+        deflate_batch(batch, payload);
+    else if (codec == codec_t::zstd)
+        zstd_batch(batch, payload);
+    else if (codec == codec_t::lz4)
+        lz4_batch(batch, payload);
+    return make_frame(opcode_t::compressed, request_id, payload);
+}
+
+/**
+ * @brief Compresses a batch by zlib, flushed so the client can inflate it whole
+ * @param batch encoded frames of the batch
+ * @param out payload the compressed data is appended to
+ */
+void reply_compressor::deflate_batch(std::string_view batch, std::string &out)
+{
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(batch.data()));
+    zs.avail_in = static_cast<uInt>(batch.size());
+    size_t used = out.size();
+    do
+    {
+        out.resize(used + deflateBound(&zs, zs.avail_in) + 16);
+        zs.next_out = reinterpret_cast<Bytef *>(out.data() + used);
+        zs.avail_out = static_cast<uInt>(out.size() - used);
+        auto ec = deflate(&zs, Z_SYNC_FLUSH);
+        // Z_BUF_ERROR: no progress possible, the flush is complete
+        if (ec != Z_OK && ec != Z_BUF_ERROR)
+            throw std::runtime_error(zs.msg ? zs.msg : "deflate failed");
+        used = out.size() - zs.avail_out;
+    } while (zs.avail_out == 0);
+    out.resize(used);
+}
+
+/**
+ * @brief Compresses a batch by zstd, flushed so the client can decompress it whole
+ * @param batch encoded frames of the batch
+ * @param out payload the compressed data is appended to
+ */
+void reply_compressor::zstd_batch([[maybe_unused]] std::string_view batch, [[maybe_unused]] std::string &out)
+{
+#ifdef JOIN_SERVER_WITH_ZSTD
+    ZSTD_inBuffer in{batch.data(), batch.size(), 0};
+    size_t used = out.size(), remaining;
+    do
+    {
+        out.resize(used + ZSTD_compressBound(batch.size() - in.pos) + 16);
+        ZSTD_outBuffer buf{out.data(), out.size(), used};
+        remaining = ZSTD_compressStream2(zstd, &buf, &in, ZSTD_e_flush);
+        if (ZSTD_isError(remaining))
+            throw std::runtime_error(ZSTD_getErrorName(remaining));
+        used = buf.pos;
+    } while (remaining);
+    out.resize(used);
+#endif
+}
+
+/**
+ * @brief Compresses a batch by LZ4 into blocks of the stream's frame, flushed
+ * @param batch encoded frames of the batch
+ * @param out payload the compressed data is appended to
+ */
+void reply_compressor::lz4_batch([[maybe_unused]] std::string_view batch, [[maybe_unused]] std::string &out)
+{
+#ifdef JOIN_SERVER_WITH_LZ4
+    LZ4F_preferences_t prefs{};
+    prefs.autoFlush = 1;
+    prefs.frameInfo.blockMode = LZ4F_blockLinked;
+    size_t used = out.size();
+    out.resize(used + LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(batch.size(), &prefs));
+    if (!lz4_begun)
+    {
+        // the first batch of the stream carries the LZ4 frame header
+        auto n = LZ4F_compressBegin(lz4, out.data() + used, out.size() - used, &prefs);
+        if (LZ4F_isError(n))
+            throw std::runtime_error(LZ4F_getErrorName(n));
+        used += n;
+        lz4_begun = true;
+    }
+    auto n = LZ4F_compressUpdate(lz4, out.data() + used, out.size() - used,
+                                 batch.data(), batch.size(), nullptr);
+    if (LZ4F_isError(n))
+        throw std::runtime_error(LZ4F_getErrorName(n));
+    out.resize(used + n);
+#endif
+}
@@ -0,0 +1,98 @@
+/**
+ * @brief input_buffer.cpp
+ * Framing buffer of received client bytes
+ *
+ */
+#include "input_buffer.h"
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * @brief Input buffer constructor
+ * @param capacity initial capacity, usually the socket receive buffer size
+ */
+input_buffer::input_buffer(size_t capacity)
+    : buf(capacity), min_read(capacity / 4 ? capacity / 4 : 1) {}
+
+/**
+ * @brief Offers free space for the next read, moving unconsumed bytes
+ *        to the front or growing the buffer when the free tail is short
+ * @return free tail of the buffer
+ */
+asio::mutable_buffer input_buffer::prepare()
+{
+    if (buf.size() - tail < min_read)
+        reserve(tail - head + min_read);
+    return asio::buffer(buf.data() + tail, buf.size() - tail);
+}
+
+/**
+ * @brief Makes room for n unconsumed bytes
+ * @param n number of bytes, counted from the head
+ */
+void input_buffer::reserve(size_t n)
+{
+    if (buf.size() - head >= n)
+        return;
+    if (head)
+    {
+        std::memmove(buf.data(), buf.data() + head, tail - head);
+        tail -= head;
+        scanned -= std::min(scanned, head);
+        head = 0;
+    }
+    if (buf.size() < n)
+        buf.resize(std::max(n, 2 * buf.size()));
+}
+
+/**
+ * @brief Drops parsed bytes from the head
+ * @param n number of bytes
+ */
+void input_buffer::consume(size_t n)
+{
+    head += n;
+    if (head == tail)
+        head = tail = scanned = 0;
+}
+
+/**
+ * @brief Finds the first delimiter among unconsumed bytes,
+ *        bytes scanned by previous calls are not scanned again
+ * @param first a delimiter
+ * @param second another delimiter
+ * @return offset from the head or std::string::npos
+ */
+size_t input_buffer::find_delimiter(char first, char second)
+{
+    size_t from = std::max(scanned, head);
+    size_t pos = from + find_first_of2(buf.data() + from, tail - from, first, second);
+    if (pos == tail)
+    {
+        scanned = tail;
+        return std::string::npos;
+    }
+    scanned = pos;
+    return pos - head;
+}
+
+size_t find_first_of2(const char *p, size_t n, char first, char second)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i f = _mm_set1_epi8(first), s = _mm_set1_epi8(second);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, f), _mm_cmpeq_epi8(chunk, s)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < n; ++i)
+        if (p[i] == first || p[i] == second)
+            return i;
+    return n;
+}
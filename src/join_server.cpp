@@ -5,155 +5,753 @@
  */
 #include "db_server.h"
 #include "join_server.h"
+#include "probes.h"
 #include <boost/asio/buffer.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/ip/address_v4.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/system/detail/error_code.hpp>
 #include <boost/asio/experimental/concurrent_channel.hpp>
+#include <boost/asio/redirect_error.hpp>
 #include <coroutine>
 #include <cstdlib>
 #include <memory>
 #include <utility>
 #include <string>
 #include <unordered_map>
+#include <vector>
+#include <iterator>
+#include <charconv>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
 
 /**
- * @brief A coroutine, called by database callback for every line of db result
- * and sending this line to client
- * @param reply the string to be sent
- * @return special asio coro type 
+ * @brief Queues a batch of encoded reply and starts the writing coro if it is idle.
+ * In binary protocol a whole reply carries its request id and may be sent
+ * ahead of batches of a longer reply
+ * @param batch the bytes to be sent
  */
-asio::awaitable<void> connection_t::send_reply(std::string reply)
+void connection_t::queue_reply(reply_batch_t batch)
 {
+    bool whole = batch.first && batch.last;
+    if (shm.is_open() && batch.data.size() >= SHM_MIN_BATCH)
+    {
+        // the client reads the batch from shared memory, the socket carries its place only
+        if (auto announce = shm.place(batch.data, batch.request_id))
+            batch.data = std::move(*announce);
+    }
+    queued_bytes += batch.data.size();
+    if (batch.last)
+    {
+        batch.queued = std::chrono::steady_clock::now();
+        ++unsent_replies;
+        p_joinserver->count_inflight(1, 0);
+    }
+    if (whole && pdbt->get_replies().get_protocol() == protocol_t::binary)
+        urgent.push_back(std::move(batch));
+    else
+        outbound.push_back(std::move(batch));
+    if (writing)
+        return;
+    writing = true;
+    last_write = p_joinserver->tick();
+    p_joinserver->arm(this);
+    asio::co_spawn(context, [self = shared_from_this()]
+                   { return self->write_replies(); }, asio::detached);
+}
+
+/**
+ * @brief A coroutine sending queued replies: urgent ones first, then batches
+ * of long replies up to MAX_WRITE_SIZE, all by a single gathering write
+ * @return special asio coro type
+ */
+asio::awaitable<void> connection_t::write_replies()
+{
+    std::vector<reply_batch_t> sending;
+    std::vector<std::string> packed; // compressed batches, in the order they are sent
+    std::vector<asio::const_buffer> buffers;
     try
     {
-        std::string line(reply);
-        auto n_sent = co_await socket.async_send(
-            asio::buffer(line),
-            asio::use_awaitable);
-        assert(n_sent == line.size());
+        while (!urgent.empty() || !outbound.empty())
+        {
+            sending.assign(std::make_move_iterator(urgent.begin()),
+                           std::make_move_iterator(urgent.end()));
+            urgent.clear();
+            for (size_t size = 0; !outbound.empty() && size < MAX_WRITE_SIZE; outbound.pop_front())
+            {
+                size += outbound.front().data.size();
+                sending.push_back(std::move(outbound.front()));
+            }
+            buffers.clear();
+            packed.clear();
+            packed.reserve(sending.size());
+            for (auto &batch : sending)
+            {
+                // compressed in the order of sending, as the client decompresses
+                if (compressor.get_codec() != codec_t::none && batch.data.size() >= COMPRESS_MIN_BATCH)
+                {
+                    packed.push_back(compressor.compress(batch.data, batch.request_id));
+                    buffers.push_back(asio::buffer(packed.back()));
+                }
+                else
+                    buffers.push_back(asio::buffer(batch.data));
+            }
+            // hold partial packets back while a reply goes on in the next writes
+            set_cork(!sending.back().last || !outbound.empty() || !urgent.empty());
+            if (passing_fd >= 0)
+            {
+                co_await pass_fd(*static_cast<const char *>(buffers.front().data()));
+                buffers.front() += 1; // sent along with the descriptor
+            }
+            trace_span span("send_reply", "connection", id.index);
+            auto written = co_await asio::async_write(socket, buffers, asio::use_awaitable);
+            bytes_out += written;
+            JOIN_SERVER_PROBE(reply_flushed, id.index, written);
+            last_write = p_joinserver->tick();
+            auto sent = std::chrono::steady_clock::now();
+            for (auto &batch : sending)
+                if (batch.last)
+                    record_latency(batch.kind, latency_phase_t::send, sent - batch.queued);
+            forget_replies(sending);
+        }
     }
-    catch (const boost::system::system_error &e)
+    catch (const std::exception &e)
     {
-        std::cerr << "Exception: " << e.what() << '\n';
-        quick_exit(1);
+        // a socket error, or a compression one breaking the stream the client decompresses
+        LOG_WARNING("connection ", id.index, ": write failed: ", e.what());
+        closing = true;
+        forget_replies(sending);
+        sending.assign(std::make_move_iterator(urgent.begin()), std::make_move_iterator(urgent.end()));
+        sending.insert(sending.end(), std::make_move_iterator(outbound.begin()), std::make_move_iterator(outbound.end()));
+        forget_replies(sending);
+        urgent.clear();
+        outbound.clear();
+    }
+    // the end of the last reply goes out now
+    set_cork(false);
+    writing = false;
+    if (closing)
+        p_joinserver->disconnect(this);
+}
+
+/**
+ * @brief Corks or uncorks a TCP connection, uncorking sends the partial packet held
+ * @param on true to cork
+ */
+void connection_t::set_cork([[maybe_unused]] bool on)
+{
+#ifdef TCP_CORK
+    if (local || on == corked || !socket.is_open())
+        return;
+    int value = on;
+    ::setsockopt(socket.native_handle(), IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+    corked = on;
+#endif
+}
+
+/**
+ * @brief Closes the connection as soon as its queued replies are sent
+ */
+void connection_t::close_after_replies()
+{
+    if (writing)
+        closing = true;
+    else
+        p_joinserver->disconnect(this);
+}
+
+/**
+ * @brief Takes sent or dropped batches off the reply accounting
+ * @param batches the batches
+ */
+void connection_t::forget_replies(const std::vector<reply_batch_t> &batches)
+{
+    size_t replies = 0;
+    for (auto &batch : batches)
+    {
+        queued_bytes -= batch.data.size();
+        replies += batch.last;
     }
-    co_return;
+    unsent_replies -= replies;
+    p_joinserver->count_inflight(0, replies);
 }
 
 /**
- * @brief Intent to be called from db_server library at every line of result
+ * @brief Sends passing_fd as SCM_RIGHTS ancillary data of a single byte
+ * @param byte the first byte of the next write
+ * @return special asio coro type
+ */
+asio::awaitable<void> connection_t::pass_fd(char byte)
+{
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &passing_fd, sizeof(int));
+
+    while (::sendmsg(socket.native_handle(), &msg, MSG_NOSIGNAL) < 0)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            throw boost::system::system_error(errno, boost::system::system_category(), "sendmsg");
+        co_await socket.async_wait(socket_t::wait_write, asio::use_awaitable);
+    }
+    passing_fd = -1;
+}
+
+/**
+ * @brief Intent to be called from db_server library for every batch of result
  * @param _pconn Points to the connection_t structure, related to this client
  * @param reply The string to be passed to the client
  */
-void join_server_callback(void *_pconn, std::string reply)
+void join_server_callback(void *_pconn, reply_batch_t reply)
 {
+    trace_span span("db_callback", "bytes", reply.data.size());
     auto pconn = static_cast<connection_t *>(_pconn);
-    asio::co_spawn(context, pconn->send_reply(reply), asio::detached);
+    pconn->queue_reply(std::move(reply));
 }
 
 /**
- * @brief Reads relational algebra commands, sent by client
+ * @brief Executes commands concerning the connection itself rather than its db
+ * @param cmd command
+ * @param request_id id of the request
+ * @param echo_id echo the request id in text replies
+ * @return true if the command was a session command
+ */
+bool connection_t::execute_session_cmd(const std::string &cmd, uint32_t request_id, bool echo_id)
+{
+    auto &replies = pdbt->get_replies();
+    if (cmd.starts_with("STATS"))
+    {
+        replies.begin(request_id, echo_id);
+        replies.set_kind(command_kind_t::session);
+        reply_stats(std::string_view(cmd).substr(std::min(cmd.size(), sizeof("STATS"))));
+        return true;
+    }
+    if (cmd == "SESSIONS")
+    {
+        replies.begin(request_id, echo_id);
+        replies.set_kind(command_kind_t::session);
+        reply_sessions();
+        return true;
+    }
+    if (cmd.starts_with("SHM"))
+    {
+        replies.begin(request_id, echo_id);
+        replies.set_kind(command_kind_t::session);
+        setup_shm(std::string_view(cmd).substr(std::min(cmd.size(), sizeof("SHM"))));
+        return true;
+    }
+    if (cmd.starts_with("COMPRESS"))
+    {
+        replies.begin(request_id, echo_id);
+        replies.set_kind(command_kind_t::session);
+        setup_compression(std::string_view(cmd).substr(std::min(cmd.size(), sizeof("COMPRESS"))));
+        return true;
+    }
+    if (!cmd.starts_with("PROTOCOL"))
+        return false;
+
+    replies.begin(request_id, echo_id);
+    replies.set_kind(command_kind_t::session);
+    auto arg = std::string_view(cmd).substr(std::min(cmd.size(), sizeof("PROTOCOL")));
+    if (arg == "TEXT" || arg == "BINARY")
+    {
+        // acknowledged in the protocol the request came in
+        replies.ok();
+        replies.set_protocol(arg == "TEXT" ? protocol_t::text : protocol_t::binary);
+    }
+    else
+        replies.error("The use is: PROTOCOL TEXT|BINARY");
+    return true;
+}
+
+/**
+ * @brief Replies with latency histograms of every command kind and phase
+ * recorded since the start or the last reset: a row of command, phase,
+ * count, min, p50, p90, p99, p99.9 and max latencies in nanoseconds each
+ * @param arg empty, or RESET to zero the histograms
+ */
+void connection_t::reply_stats(std::string_view arg)
+{
+    auto &replies = pdbt->get_replies();
+    if (arg == "RESET")
+    {
+        latencies.reset();
+        replies.ok();
+        return;
+    }
+    if (!arg.empty())
+    {
+        replies.error("The use is: STATS [RESET]");
+        return;
+    }
+    for (size_t kind = 0; kind < COMMAND_KIND_NAMES.size(); ++kind)
+        for (size_t phase = 0; phase < LATENCY_PHASE_NAMES.size(); ++phase)
+        {
+            auto s = latencies.snapshot(static_cast<command_kind_t>(kind), static_cast<latency_phase_t>(phase));
+            if (!s.total)
+                continue;
+            replies.row({COMMAND_KIND_NAMES[kind], LATENCY_PHASE_NAMES[phase],
+                         static_cast<int64_t>(s.total), static_cast<int64_t>(s.min()),
+                         static_cast<int64_t>(s.percentile(50)), static_cast<int64_t>(s.percentile(90)),
+                         static_cast<int64_t>(s.percentile(99)), static_cast<int64_t>(s.percentile(99.9)),
+                         static_cast<int64_t>(s.max)});
+        }
+    replies.ok();
+}
+
+/**
+ * @brief Replies with the resources used by every connection: a row of
+ * connection id, peer, commands, CPU time of commands in microseconds,
+ * result rows, bytes received, bytes sent, bytes queued for sending,
+ * SQLite page cache, schema and prepared statements bytes each.
+ * An admin command: it shows every tenant, so only local clients get it
+ */
+void connection_t::reply_sessions()
+{
+    auto &replies = pdbt->get_replies();
+    if (!local)
+    {
+        replies.error("SESSIONS is served over the Unix domain socket only");
+        return;
+    }
+    p_joinserver->for_each_connection(
+        [&replies](handle_t &conn)
+        {
+            auto usage = conn->pdbt->get_usage();
+            replies.row({static_cast<int64_t>(conn->id.index), std::string_view(conn->peer),
+                         static_cast<int64_t>(usage.commands), static_cast<int64_t>(usage.cpu_ns / 1000),
+                         static_cast<int64_t>(usage.rows), static_cast<int64_t>(conn->bytes_in),
+                         static_cast<int64_t>(conn->bytes_out), static_cast<int64_t>(conn->queued_bytes),
+                         static_cast<int64_t>(usage.cache_bytes), static_cast<int64_t>(usage.schema_bytes),
+                         static_cast<int64_t>(usage.stmt_bytes)});
+        });
+    replies.ok();
+}
+
+/**
+ * @brief Logs latency histograms of every command kind and phase
+ */
+void log_stats()
+{
+    for (size_t kind = 0; kind < COMMAND_KIND_NAMES.size(); ++kind)
+        for (size_t phase = 0; phase < LATENCY_PHASE_NAMES.size(); ++phase)
+        {
+            auto s = latencies.snapshot(static_cast<command_kind_t>(kind), static_cast<latency_phase_t>(phase));
+            if (s.total)
+                LOG_INFO("latency ", COMMAND_KIND_NAMES[kind], " ", LATENCY_PHASE_NAMES[phase],
+                         ": count ", s.total, " p50 ", s.percentile(50), " p99 ", s.percentile(99),
+                         " p99.9 ", s.percentile(99.9), " max ", s.max, " ns");
+        }
+}
+
+/**
+ * @brief Logs latency histograms periodically
+ * @param period how often
  * @return special asio coro type
  */
-asio::awaitable<void> connection_t::read_requests()
+asio::awaitable<void> dump_stats(std::chrono::seconds period)
 {
+    asio::steady_timer timer(context);
+    while (!p_joinserver->is_draining())
+    {
+        timer.expires_after(period);
+        co_await timer.async_wait(asio::use_awaitable);
+        log_stats();
+    }
+}
 
-    constexpr size_t buf_size = 1024;
-    std::string cmd;
-    std::string line(buf_size, '\0');
+/**
+ * @brief Sets up the shared memory ring for long replies, its descriptor
+ * is passed along with the acknowledgement
+ * @param arg ring size in bytes
+ */
+void connection_t::setup_shm(std::string_view arg)
+{
+    auto &replies = pdbt->get_replies();
+    size_t size = 0;
+    auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), size);
+    if (!local || replies.get_protocol() != protocol_t::binary)
+        replies.error("SHM needs binary protocol over the Unix domain socket");
+    else if (ec != std::errc() || ptr != arg.data() + arg.size() || size < SHM_MIN_SIZE || size > SHM_MAX_SIZE)
+        replies.error("The use is: SHM <bytes>, " + std::to_string(SHM_MIN_SIZE) +
+                      " to " + std::to_string(SHM_MAX_SIZE));
+    else if (shm.is_open())
+        replies.error("Shared memory is already set up");
+    else
+    {
+        try
+        {
+            shm.open(size);
+        }
+        catch (const std::system_error &e)
+        {
+            replies.error(e.what());
+            return;
+        }
+        passing_fd = shm.get_fd();
+        replies.ok();
+    }
+}
+
+/**
+ * @brief Rejects a command at once if the server or the connection is overloaded
+ * @param request_id id of the request
+ * @param echo_id echo the request id in text replies
+ * @return true if the command may be executed
+ */
+bool connection_t::admit(uint32_t request_id, bool echo_id)
+{
+    const char *reason = p_joinserver->is_busy() ? "Server is busy"
+                         : queued_bytes >= p_joinserver->get_limits().max_queued_bytes
+                             ? "Too many replies are not received"
+                             : nullptr;
+    if (!reason)
+    {
+        last_admitted = p_joinserver->tick();
+        return true;
+    }
+    pdbt->get_replies().begin(request_id, echo_id);
+    pdbt->get_replies().error(reason);
+    return false;
+}
+
+/**
+ * @brief Starts a new compression stream for long reply batches
+ * @param arg codec name
+ */
+void connection_t::setup_compression(std::string_view arg)
+{
+    auto &replies = pdbt->get_replies();
+    auto codec = reply_compressor::codec_of(arg);
+    if (replies.get_protocol() != protocol_t::binary)
+        replies.error("COMPRESS needs binary protocol");
+    else if (!codec)
+        replies.error("The use is: COMPRESS ZLIB|LZ4|ZSTD|NONE, the codec must be built in");
+    else
+    {
+        try
+        {
+            compressor.reset(*codec);
+        }
+        catch (const std::exception &e)
+        {
+            replies.error(e.what());
+            return;
+        }
+        // the acknowledgement is short, never compressed
+        replies.ok();
+    }
+}
+
+/**
+ * @brief Executes a command
+ * @param cmd command, in text protocol optionally tagged as "#<request id> <command>"
+ * @param request_id id of the request from binary frame header
+ */
+void connection_t::execute(const std::string &cmd, uint32_t request_id)
+{
+    JOIN_SERVER_PROBE(command_received, id.index, request_id, cmd.c_str(), cmd.size());
+    bool tagged = pdbt->get_replies().get_protocol() == protocol_t::text && cmd.starts_with('#');
+    if (!tagged && !admit(request_id, false))
+        return;
+    if (tagged)
+    {
+        auto space = cmd.find(CMD_DELIM);
+        auto [ptr, ec] = std::from_chars(cmd.data() + 1, cmd.data() + std::min(space, cmd.size()), request_id);
+        if (ec != std::errc() || space == std::string::npos || ptr != cmd.data() + space)
+        {
+            pdbt->get_replies().begin(0);
+            pdbt->get_replies().error("Bad request id");
+            return;
+        }
+        std::string untagged = cmd.substr(space + 1);
+        if (!admit(request_id, true))
+            return;
+        if (!execute_session_cmd(untagged, request_id, true))
+            pdbt->execute_cmd(untagged, request_id, true);
+        return;
+    }
+    if (!execute_session_cmd(cmd, request_id, false))
+        pdbt->execute_cmd(cmd, request_id);
+}
 
+/**
+ * @brief Answers a command longer than MAX_COMMAND_SIZE
+ * @param request_id id of the request
+ * @return true to disconnect the client, the rest of its input can not be framed
+ */
+bool connection_t::reject_input(uint32_t request_id)
+{
+    pdbt->get_replies().begin(request_id);
+    pdbt->get_replies().error("Command is too long");
+    return true;
+}
+
+/**
+ * @brief Splits received bytes into commands and executes them:
+ * \n - delimited lines in text protocol, frames in binary protocol.
+ * Protocol may change between two commands of the same input
+ * @return true if the client asked to disconnect
+ */
+bool connection_t::process_input()
+{
+    bool disconnect = false;
+    while (!disconnect)
+    {
+        auto received = input.data();
+        std::string cmd;
+        uint32_t request_id = 0;
+        if (pdbt->get_replies().get_protocol() == protocol_t::binary)
+        {
+            if (received.size() < FRAME_HEADER_SIZE)
+                break;
+            auto header = get_frame_header(received.data());
+            if (header.length > MAX_COMMAND_SIZE)
+                return reject_input(header.request_id);
+            if (received.size() - FRAME_HEADER_SIZE < header.length)
+            {
+                // let the next read take the whole frame
+                input.reserve(FRAME_HEADER_SIZE + header.length);
+                break;
+            }
+            if (header.opcode == opcode_t::shm_release)
+            {
+                if (header.length >= sizeof(uint64_t))
+                    shm.release(get_le<uint64_t>(received.data() + FRAME_HEADER_SIZE));
+                input.consume(FRAME_HEADER_SIZE + header.length);
+                continue;
+            }
+            cmd = received.substr(FRAME_HEADER_SIZE, header.length);
+            request_id = header.request_id;
+            input.consume(FRAME_HEADER_SIZE + header.length);
+            disconnect = (header.opcode == opcode_t::disconnect);
+        }
+        else
+        {
+            // There can be several \n - delimited commands in the input
+            // or/and an unfinished command whith no delimiter at the end
+            auto end = input.find_delimiter(END_OF_CHUNK, DISCONNECT);
+            if (end == std::string::npos && received.size() > MAX_COMMAND_SIZE)
+                return reject_input(0);
+            if (end == std::string::npos)
+                break;
+            cmd = received.substr(0, end);
+            // Process DISCONNECT symbol, received from client
+            disconnect = (received[end] == DISCONNECT);
+            input.consume(end + 1);
+        }
+        if (!disconnect)
+        {
+            last_read = p_joinserver->tick();
+            execute(cmd, request_id);
+        }
+    }
+    return disconnect;
+}
+
+/**
+ * @brief Reads relational algebra commands, sent by client,
+ * straight into the input buffer sized to the socket receive buffer
+ * @return special asio coro type
+ */
+asio::awaitable<void> connection_t::read_requests()
+{
     try
     {
+        asio::socket_base::receive_buffer_size rcvbuf;
+        socket.get_option(rcvbuf);
+        input = input_buffer(std::max(rcvbuf.value(), 1024));
+
         while (true)
         {
 
             auto n_read = co_await socket.async_read_some(
-                asio::buffer(line),
+                input.prepare(),
                 asio::use_awaitable);
             if (!n_read)
             {
-                std::cerr << "Zero bytes read " << "\n";
+                LOG_ERROR("zero bytes read");
                 quick_exit(1);
             }
+            bool was_empty = input.data().empty();
+            input.commit(n_read);
+            bytes_in += n_read;
 
-            // Begin processing \n - delimited input string
-            std::string_view s(line.begin(), line.begin() + n_read);
-
-            // Process DISCONNECT symbol, received from client
-            auto pos = line.find(DISCONNECT);
-            bool disconnect = (pos != std::string::npos);
-            if (disconnect)
-                s = s.substr(0, pos);
-
-            // There can be several \n - delimited commands in the input string
-            // or/and an unfinished command whith no delimiter at the end
-            auto prev_pos = pos = 0;
-
-            while (prev_pos < s.size())
+            bool disconnect;
             {
-                pos = s.find("\n", prev_pos);
-                if (pos == std::string::npos)
-                {
-                    cmd.append(s, prev_pos, s.size() - prev_pos);
-                    break;
-                }
-                cmd.append(s, prev_pos, pos - prev_pos);
-                prev_pos = pos + 1;
-                pdbt->execute_cmd(cmd);
-
-                cmd.clear();
+                trace_span span("read_requests", "bytes", n_read);
+                disconnect = process_input();
             }
             // On DISCONNECT close socket and return
             if (disconnect)
             {
-                p_joinserver->disconnect(this);
+                close_after_replies();
                 co_return;
             }
+            if (!input.data().empty() && (was_empty || last_read == p_joinserver->tick()))
+                partial_since = p_joinserver->tick();
+            p_joinserver->arm(this);
         }
     }
     catch (const boost::system::system_error &e)
     {
-        std::cerr << "Exception: " << e.what() << '\n';
-        quick_exit(1);
+        // reading is shut down by drain or the connection is closed on timeout
+        if (p_joinserver->is_draining() || e.code() == asio::error::operation_aborted)
+            co_return;
+        // a client gone without DISCONNECT costs its own connection only
+        if (e.code() == asio::error::eof || e.code() == asio::error::connection_reset)
+        {
+            close_after_replies();
+            co_return;
+        }
+        // e.g. timed out or unreachable peer, the other connections go on
+        LOG_WARNING("connection ", id.index, ": read failed: ", e.what());
+        p_joinserver->disconnect(this);
     }
 }
 
 /**
- * @brief Listen to clients connections, creates a connection, a database 
+ * @brief Finds the address of a TCP client
+ * @param socket connected socket
+ * @return "<address>:<port>", empty if the client is gone
+ */
+static std::string peer_name(socket_t &socket)
+{
+    boost::system::error_code ec;
+    auto remote = socket.remote_endpoint(ec);
+    asio::ip::tcp::endpoint endpoint;
+    if (ec || remote.size() > endpoint.capacity())
+        return {};
+    std::memcpy(endpoint.data(), remote.data(), remote.size());
+    endpoint.resize(remote.size());
+    return endpoint.address().to_string() + ":" + std::to_string(endpoint.port());
+}
+
+/**
+ * @brief Accepts clients connections, creates a connection, a database 
  *         and a reading commands session for each client connected
- * @param context asio io context
+ * @param acceptor TCP or Unix domain socket acceptor
+ * @param local true for the Unix domain socket
  * @return special asio coro type
  */
-asio::awaitable<void> run_server(asio::io_context &context)
+template <typename Acceptor>
+asio::awaitable<void> accept_clients(Acceptor &acceptor, bool local)
 {
     try
     {
-
-        asio::ip::tcp::acceptor acceptor(context, asio::ip::tcp::endpoint{asio::ip::make_address_v4(p_joinserver->get_ip_addr()), p_joinserver->get_port()});
+        asio::steady_timer backoff(context);
         while (true)
         {
-            // Some parts of a connected socket can not be moved to another location
-            // so we preliminary prepare the needed place for creating there a connected socket
-            auto handle = std::make_shared<connection_t>(std::string(""),
-                                                         join_server_callback);
-            co_await acceptor.async_accept(handle->socket, asio::use_awaitable);
+            socket_t peer{context};
+            boost::system::error_code ec;
+            co_await acceptor.async_accept(peer, asio::redirect_error(asio::use_awaitable, ec));
+            if (ec == asio::error::no_descriptors || ec.value() == ENFILE ||
+                ec == asio::error::no_buffer_space || ec == asio::error::no_memory)
+            {
+                // the clients wait in the backlog until connections are closed
+                LOG_WARNING("accept failed: ", ec.message(), ", accepting is suspended");
+                backoff.expires_after(ACCEPT_BACKOFF);
+                co_await backoff.async_wait(asio::use_awaitable);
+                continue;
+            }
+            if (ec == asio::error::connection_aborted || ec.value() == EPROTO || ec.value() == EPERM)
+                continue; // the client is gone before it is accepted
+            if (ec)
+                throw boost::system::system_error(ec);
+
+            if (p_joinserver->connections.size() >= p_joinserver->limits.max_connections)
+            {
+                // rejected before a database is made for the client
+                peer.send(asio::buffer(std::string_view("Eror: Too many connections\n^")), 0, ec);
+                peer.close(ec);
+                continue;
+            }
+
+            handle_t handle;
+            try
+            {
+                handle = std::make_shared<connection_t>(std::string(""),
+                                                        join_server_callback,
+                                                        std::move(peer));
+            }
+            catch (const std::runtime_error &e)
+            {
+                // the database is not made, the socket is not taken by the connection
+                LOG_WARNING("connection refused: ", e.what());
+                peer.send(asio::buffer("Eror: " + std::string(e.what()) + "\n^"), 0, ec);
+                peer.close(ec);
+                continue;
+            }
+            handle->local = local;
+            handle->peer = local ? "unix" : peer_name(handle->socket);
+            if (!local)
+            {
+                // short replies are not delayed, long ones are corked while they are written
+                boost::system::error_code ec;
+                handle->socket.set_option(asio::ip::tcp::no_delay(true), ec);
+#ifdef SO_BUSY_POLL
+                int busy_poll = static_cast<int>(p_joinserver->get_io().busy_poll_us);
+                if (busy_poll)
+                    ::setsockopt(handle->socket.native_handle(), SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll));
+#endif
+            }
 
-            p_joinserver->connections.push_back(handle);
+            handle->id = p_joinserver->connections.insert(io_thread, handle);
+            handle->last_read = p_joinserver->tick();
+            p_joinserver->arm(handle.get());
 
             handle->pdbt->execute_cmd("CREATE");
 
-            std::cout << "connected " << "\n";
+            LOG_INFO("connection ", handle->id.index, " connected from ", handle->peer);
 
-            // Start reading coro for this connection, 
-            // initialized socket is already being in connection_t body
-            asio::co_spawn(context, handle->read_requests(), asio::detached);
+            // Start reading coro for this connection, it keeps the connection alive
+            asio::co_spawn(acceptor.get_executor(), [handle]
+                           { return handle->read_requests(); }, asio::detached);
         }
     }
     catch (const std::exception &ex)
     {
-        std::cerr << "Exception: " << ex.what() << "\n";
+        // the acceptor is closed by drain
+        if (p_joinserver->is_draining())
+            co_return;
+        LOG_ERROR("accept failed: ", ex.what());
+        quick_exit(1);
+    }
+}
+
+/**
+ * @brief Listen to clients connections at TCP port and Unix domain socket
+ * @param context asio io context
+ * @return special asio coro type
+ */
+asio::awaitable<void> run_server(asio::io_context &context)
+{
+    try
+    {
+        auto &acceptor = p_joinserver->acceptor.emplace(context, asio::ip::tcp::endpoint{asio::ip::make_address_v4(p_joinserver->get_ip_addr()), p_joinserver->get_port()});
+
+        // a socket file left by a previous run would make bind fail
+        ::unlink(p_joinserver->get_unix_path().c_str());
+        auto &local_acceptor = p_joinserver->local_acceptor.emplace(context, asio::local::stream_protocol::endpoint{p_joinserver->get_unix_path()});
+
+        asio::co_spawn(context, accept_clients(local_acceptor, true), asio::detached);
+        co_await accept_clients(acceptor, false);
+    }
+    catch (const std::exception &ex)
+    {
+        LOG_ERROR("can not listen: ", ex.what());
         quick_exit(1);
     }
 }
@@ -162,17 +760,24 @@ asio::awaitable<void> run_server(asio::io_context &context)
  * @brief join_server_t object consructor
  * @param _ip_addr ip address of 'join server'
  * @param _port port of join server
+ * @param _unix_path Unix domain socket path of join server
+ * @param _limits overload limits
+ * @param _io io thread options
  */
-join_server_t::join_server_t(const std::string _ip_addr, port_t _port)
-    : ip_addr(_ip_addr), port(_port)
+join_server_t::join_server_t(const std::string _ip_addr, port_t _port, const std::string _unix_path,
+                             const server_limits &_limits, const io_options &_io)
+    : ip_addr(_ip_addr), port(_port), unix_path(_unix_path), limits(_limits), io(_io)
 {
     db_t::clean_directory("");
 }
 
 /**
- * @brief join_server_t destructor - default in this version
+ * @brief join_server_t destructor, removes the Unix domain socket file
  */
-join_server_t::~join_server_t() {}
+join_server_t::~join_server_t()
+{
+    ::unlink(unix_path.c_str());
+}
 
 /**
  * @brief Disconnect a client. Is called when disconnection character is received
@@ -180,58 +785,236 @@ join_server_t::~join_server_t() {}
  */
 void join_server_t::disconnect(connection_t *conn)
 {
+    // already disconnected by another path
+    if (!connections.get(conn->id))
+        return;
+    auto index = conn->id.index;
     try
     {
         conn->socket.close();
-        for (auto i = connections.begin(); i != connections.end(); ++i)
-            if (i->get() == conn)
-            {
-                connections.erase(i);
-                break;
-            }
+        count_inflight(0, conn->unsent_replies);
+        // may release the connection, conn is not used further
+        connections.erase(conn->id);
     }
     catch (const std::exception &ex)
     {
-        std::cerr << "Exception: " << ex.what() << "\n";
+        LOG_ERROR("disconnect failed: ", ex.what());
         quick_exit(1);
     }
 
-    std::cout << "disconnected " << "\n";
+    LOG_INFO("connection ", index, " disconnected");
+}
+/**
+ * @brief Shuts the server down softly: stops accepting clients and reading
+ * requests, then waits for the replies of commands already executed to be
+ * sent, DRAIN_DEADLINE at most, and stops the coro loop
+ * @return special asio coro type
+ */
+asio::awaitable<void> join_server_t::drain()
+{
+    draining = true;
+    LOG_INFO("draining ", connections.size(), " connections");
+
+    boost::system::error_code ec;
+    if (acceptor)
+        acceptor->close(ec);
+    if (local_acceptor)
+        local_acceptor->close(ec);
+    for_each_connection([&ec](handle_t &conn)
+                        { conn->socket.shutdown(socket_t::shutdown_receive, ec); });
+
+    asio::steady_timer timer(context);
+    auto deadline = std::chrono::steady_clock::now() + DRAIN_DEADLINE;
+    auto sending = [this]
+    {
+        bool writing = false;
+        for_each_connection([&writing](handle_t &conn)
+                            { writing |= conn->writing; });
+        return writing;
+    };
+    while (sending() && std::chrono::steady_clock::now() < deadline)
+    {
+        timer.expires_after(std::chrono::milliseconds(10));
+        co_await timer.async_wait(asio::use_awaitable);
+    }
+    context.stop(); // stop the coro loop
 }
+
+/**
+ * @brief Waits for SIGINT or SIGTERM to drain the server,
+ * the second signal stops it at once
+ * @return special asio coro type
+ */
+asio::awaitable<void> handle_signals()
+{
+    asio::signal_set signals(context, SIGINT, SIGTERM);
+    co_await signals.async_wait(asio::use_awaitable);
+    asio::co_spawn(context, p_joinserver->drain(), asio::detached);
+    co_await signals.async_wait(asio::use_awaitable);
+    context.stop();
+}
+
+/**
+ * @brief The tick the connection times out at: the write timeout counts
+ * while replies are sent, the read timeout while a command is unfinished,
+ * the idle timeout otherwise. Commands admitted meanwhile count as progress
+ * of a write: a client pipelining a batch reads the replies only after it
+ * is sent, but one stuck at max_queued_bytes gets its commands rejected
+ * @return tick
+ */
+uint64_t connection_t::deadline() const
+{
+    auto &limits = p_joinserver->get_limits();
+    if (writing)
+        return std::max(last_write, last_admitted) + limits.write_timeout;
+    if (!input.data().empty())
+        return partial_since + limits.read_timeout;
+    return last_read + limits.idle_timeout;
+}
+
+/**
+ * @brief Arms a timer for the deadline of a connection unless an earlier one is armed.
+ * Timers are not cancelled when the deadline moves later, the one expiring checks it
+ * @param conn the connection
+ */
+void join_server_t::arm(connection_t *conn)
+{
+    auto expiry = conn->deadline();
+    if (conn->scheduled && conn->scheduled <= expiry)
+        return;
+    timers.insert(expiry, conn->id);
+    conn->scheduled = expiry;
+}
+
+/**
+ * @brief Ticks the timer wheel by the steady clock and closes connections
+ * past their deadlines. A connection past its deadline gets one more tick
+ * first: while the loop is busy, e.g. on a long command, the I/O of the
+ * other connections waits, so their progress may not be seen yet
+ * @return special asio coro type
+ */
+asio::awaitable<void> join_server_t::expire_connections()
+{
+    asio::steady_timer timer(context);
+    while (true)
+    {
+        timer.expires_at(started + (timers.get_now() + 1) * TIMER_TICK);
+        co_await timer.async_wait(asio::use_awaitable);
+        uint64_t tick = (std::chrono::steady_clock::now() - started) / TIMER_TICK;
+        timers.advance(tick,
+                       [this, tick](slot_handle_t id, uint64_t now)
+                       {
+                           auto conn = connections.get(id);
+                           if (!conn)
+                               return; // closed meanwhile
+                           auto handle = *conn;
+                           if (handle->scheduled == now)
+                               handle->scheduled = 0;
+                           if (handle->deadline() > now)
+                           {
+                               handle->graced = false;
+                               arm(handle.get());
+                           }
+                           else if (!handle->graced)
+                           {
+                               // the pending I/O runs before the next tick
+                               handle->graced = true;
+                               timers.insert(tick + 1, id);
+                               handle->scheduled = tick + 1;
+                           }
+                           else
+                           {
+                               LOG_INFO("connection ", id.index, " timed out");
+                               disconnect(handle.get());
+                           }
+                       });
+    }
+}
+
 /**
  * @brief Connection object constructor, constructs underlying db as well
  * @param _db_directory The directory, where all the client's databases lies
  * the names of db's include connection handle representation
  * @param foreign_callback 
+ * @param _socket accepted socket
  */
 connection_t::connection_t(std::string _db_directory,
-                           foreign_callback_t foreign_callback)
+                           foreign_callback_t foreign_callback,
+                           socket_t &&_socket)
     : pdbt(std::make_shared<db_t>(_db_directory,
                                   foreign_callback,
                                   this)),
-      socket{context} {}
+      socket{std::move(_socket)} {}
+
+/**
+ * @brief Pins the io thread to its core or NUMA node and makes it allocate
+ * on that node, before any connection memory is allocated.
+ * The node of a pinned core is used when no node is given
+ * @param io io thread options
+ */
+void place_io_thread(const io_options &io)
+{
+    if (io.cpu != NO_CPU && !pin_current_thread(io.cpu))
+        LOG_WARNING("can not pin the io thread to core ", io.cpu);
+    if (io.numa_node != NO_NODE && io.cpu == NO_CPU && !pin_current_thread_to_node(io.numa_node))
+        LOG_WARNING("can not pin the io thread to NUMA node ", io.numa_node);
+
+    auto node = io.numa_node != NO_NODE ? io.numa_node : io.cpu != NO_CPU ? node_of_cpu(io.cpu) : NO_NODE;
+    if (node != NO_NODE && !prefer_node(node))
+        LOG_WARNING("can not allocate on NUMA node ", node);
+}
 
 /**
  * @brief main join_server func
- * @param argc 0 or 1
- * @param argv the server port can be specified 
+ * @param argc number of args
+ * @param argv the server port, the Unix domain socket path, limits and io options can be specified 
  * @return 0 
  */
 int main(int argc, char **argv)
 {
     port_t port;
+    std::string unix_path;
+    server_limits limits;
+    io_options io;
+    monitor_options monitor;
     std::srand(std::time(nullptr));
-    if (!get_params(argc, argv, port))
+    if (!get_params(argc, argv, port, unix_path, limits, io, monitor))
         return 0;
-    p_joinserver = std::make_unique<join_server_t>(default_ip, port);
+    // the io thread only formats messages, the drain thread writes them
+    logger.start(static_cast<log_level_t>(monitor.log_level));
+    if (!monitor.trace_path.empty())
+        tracer.start(monitor.trace_path);
+    db_t::set_slow_threshold(std::chrono::milliseconds(monitor.slow_command_ms));
+    std::at_quick_exit([]
+                       { logger.stop(); });
+    // fatal errors are where a trace is wanted most, runs before the logger stops
+    std::at_quick_exit([]
+                       {
+                           if (!tracer.finish())
+                               LOG_ERROR("can not write trace");
+                       });
+    place_io_thread(io);
+    p_joinserver = std::make_unique<join_server_t>(default_ip, port, unix_path, limits, io);
     p_joinserver->print_running();
 
     // Start server coro
     asio::co_spawn(context, run_server(context), asio::detached);
 
-    establish_SIGINT_handler();
+    asio::co_spawn(context, handle_signals(), asio::detached);
+    asio::co_spawn(context, p_joinserver->expire_connections(), asio::detached);
+    if (monitor.stats_period)
+        asio::co_spawn(context, dump_stats(std::chrono::seconds(monitor.stats_period)), asio::detached);
 
     // Starts coro loop
-    context.run();
+    if (io.busy_poll_us)
+    {
+        // spin: never sleep in epoll_wait, handlers run as soon as events arrive
+        while (!context.stopped())
+            context.poll();
+    }
+    else
+        context.run();
+    if (!tracer.finish())
+        LOG_ERROR("can not write trace to ", monitor.trace_path);
     return 0;
 }
@@ -0,0 +1,79 @@
+/**
+ * @brief placement.cpp
+ * Placement of server threads on cores and NUMA nodes.
+ * A connection is owned by the thread running its coros, which allocates and
+ * first touches its buffers and its SQLite caches, so the memory of a connection
+ * follows the memory policy of its thread
+ *
+ */
+#include "placement.h"
+#include <pthread.h>
+#include <sched.h>
+#ifdef JOIN_SERVER_WITH_NUMA
+#include <numa.h>
+#endif
+
+/**
+ * @brief Pins the calling thread to a core
+ * @param cpu core number
+ * @return true on success
+ */
+bool pin_current_thread(size_t cpu)
+{
+    if (cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+/**
+ * @brief Pins the calling thread to the cores of a NUMA node
+ * @param node node number
+ * @return true on success
+ */
+bool pin_current_thread_to_node([[maybe_unused]] size_t node)
+{
+#ifdef JOIN_SERVER_WITH_NUMA
+    if (numa_available() < 0 || node > static_cast<size_t>(numa_max_node()))
+        return false;
+    return numa_run_on_node(static_cast<int>(node)) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Finds the NUMA node of a core
+ * @param cpu core number
+ * @return node number or NO_NODE
+ */
+size_t node_of_cpu([[maybe_unused]] size_t cpu)
+{
+#ifdef JOIN_SERVER_WITH_NUMA
+    if (numa_available() < 0)
+        return NO_NODE;
+    int node = numa_node_of_cpu(static_cast<int>(cpu));
+    return node < 0 ? NO_NODE : static_cast<size_t>(node);
+#else
+    return NO_NODE;
+#endif
+}
+
+/**
+ * @brief Makes the calling thread allocate memory on a NUMA node while it has room
+ * @param node node number
+ * @return true on success
+ */
+bool prefer_node([[maybe_unused]] size_t node)
+{
+#ifdef JOIN_SERVER_WITH_NUMA
+    if (numa_available() < 0 || node > static_cast<size_t>(numa_max_node()))
+        return false;
+    numa_set_preferred(static_cast<int>(node));
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,84 @@
+/**
+ * @brief shm_ring.cpp
+ * Shared memory transport of replies to local clients
+ *
+ */
+#include "shm_ring.h"
+#include "wire_protocol.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+/**
+ * @brief Unmaps and closes the ring
+ */
+shm_ring::~shm_ring()
+{
+    if (base)
+        munmap(base, capacity);
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+ * @brief Creates the memfd backing the ring and maps it
+ * @param size ring size in bytes
+ */
+void shm_ring::open(size_t size)
+{
+    int memfd = memfd_create("join_server_replies", MFD_CLOEXEC);
+    if (memfd < 0)
+        throw std::system_error(errno, std::generic_category(), "memfd_create");
+    if (ftruncate(memfd, size) < 0)
+    {
+        int err = errno;
+        close(memfd);
+        throw std::system_error(err, std::generic_category(), "ftruncate");
+    }
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (p == MAP_FAILED)
+    {
+        int err = errno;
+        close(memfd);
+        throw std::system_error(err, std::generic_category(), "mmap");
+    }
+    fd = memfd;
+    base = static_cast<char *>(p);
+    capacity = size;
+}
+
+/**
+ * @brief Copies a reply batch into the ring
+ * @param batch encoded frames of the batch
+ * @param request_id request id of the reply
+ * @return SHM_DATA frame announcing the batch, nothing if the ring has no room
+ */
+std::optional<std::string> shm_ring::place(std::string_view batch, uint32_t request_id)
+{
+    size_t offset = written % capacity;
+    size_t padding = (capacity - offset < batch.size()) ? capacity - offset : 0;
+    if (capacity - (written - released) < padding + batch.size())
+        return std::nullopt;
+
+    offset = (offset + padding) % capacity;
+    std::memcpy(base + offset, batch.data(), batch.size());
+    written += padding + batch.size();
+
+    std::string payload;
+    put_le(payload, static_cast<uint32_t>(offset));
+    put_le(payload, static_cast<uint32_t>(batch.size()));
+    put_le(payload, written);
+    return make_frame(opcode_t::shm_data, request_id, payload);
+}
+
+/**
+ * @brief Gives space back to the ring
+ * @param mark release mark of the last SHM_DATA frame the client is done with
+ */
+void shm_ring::release(uint64_t mark)
+{
+    if (mark > released && mark <= written)
+        released = mark;
+}